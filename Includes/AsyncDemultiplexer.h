@@ -0,0 +1,63 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - AsyncDemultiplexer.h
+ *
+ * This file contains the header for an AsyncDemultiplexer class which hands asynchronous data from the PSP to whoever
+ * handles its channel.
+ *
+ **/
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+
+class AsyncCommandView;
+class DebugPrintLane;
+
+/**
+ * Routes asynchronous data from the PSP by channel. Packets on the user channel stay with USBReader, debug prints go
+ * to a DebugPrintLane, other channels go to handlers registered for them.
+ * Only used from the USB thread, handlers are called on it too so they should be quick.
+ */
+class AsyncDemultiplexer
+{
+public:
+    using Handler = std::function<void(std::string_view)>;
+
+    /**
+     * Registers a handler for a channel, must be called before the PSP starts sending.
+     * @param aChannel - The channel to handle.
+     * @param aHandler - Gets the data after the asynchronous header.
+     */
+    void RegisterHandler(uint32_t aChannel, Handler aHandler);
+
+    /**
+     * Sets where debug prints go, without a lane they get logged right away.
+     * @param aLane - The lane to use.
+     */
+    void SetDebugPrintLane(std::shared_ptr<DebugPrintLane> aLane);
+
+    /**
+     * Hands a debug print from the PSP to the lane.
+     * @param aPrint - The print.
+     */
+    void PostDebugPrint(std::string_view aPrint);
+
+    /**
+     * Hands data on any channel but the user channel to its handler.
+     * @param aData - The data including the asynchronous header.
+     */
+    void Dispatch(const AsyncCommandView& aData);
+
+    /**
+     * @return Amount of chunks on channels no handler was registered for.
+     */
+    [[nodiscard]] uint64_t GetUnhandledCount() const;
+
+private:
+    std::unordered_map<uint32_t, Handler> mHandlers{};
+    std::shared_ptr<DebugPrintLane>       mDebugPrintLane{nullptr};
+    uint64_t                              mUnhandled{0};
+};
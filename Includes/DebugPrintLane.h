@@ -0,0 +1,77 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - DebugPrintLane.h
+ *
+ * This file contains the header for a DebugPrintLane class which writes debug prints from the PSP on its own thread.
+ *
+ **/
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace DebugPrintLane_Constants
+{
+    // Prints waiting to be written, anything above this gets dropped so a chatty plugin can't eat all memory.
+    constexpr std::size_t      cMaxQueuedPrints{256};
+    constexpr std::string_view cPrefix{"PSP: "};
+}  // namespace DebugPrintLane_Constants
+
+/**
+ * Takes debug prints from the PSP off the USB thread, so formatting and writing them does not hold up frames. Prints
+ * go to a file if one is given, to the Logger otherwise.
+ * Post() can be called from any thread.
+ */
+class DebugPrintLane
+{
+public:
+    DebugPrintLane() = default;
+    ~DebugPrintLane();
+    DebugPrintLane(const DebugPrintLane& aDebugPrintLane) = delete;
+    DebugPrintLane& operator=(const DebugPrintLane& aDebugPrintLane) = delete;
+
+    /**
+     * Starts the thread writing the prints.
+     * @param aPath - File to append the prints to, empty to log them.
+     * @return true if successful.
+     */
+    bool Start(const std::string& aPath);
+
+    /**
+     * Writes whatever is still queued and stops the thread.
+     */
+    void Stop();
+
+    /**
+     * Queues a print, only copies it.
+     * @param aPrint - The print as it came from the PSP.
+     */
+    void Post(std::string_view aPrint);
+
+    /**
+     * @return Amount of prints dropped because the queue was full.
+     */
+    [[nodiscard]] uint64_t GetDroppedCount() const;
+
+private:
+    /**
+     * Writes a single print.
+     * @param aPrint - The print to write.
+     */
+    void Write(std::string_view aPrint);
+
+    std::mutex                   mMutex{};
+    std::condition_variable      mCondition{};
+    std::queue<std::string>      mPrints{};
+    bool                         mStopRequest{false};
+    std::atomic<uint64_t>        mDropped{0};
+    std::ofstream                mFile{};
+    std::shared_ptr<std::thread> mThread{nullptr};
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - Engine.h
+ *
+ * This file contains the header for an Engine class which starts, stops and restarts the bridge.
+ *
+ **/
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "SettingsModel.h"
+
+class DebugPrintLane;
+class LocalSwitch;
+class PacketFilter;
+class USBReader;
+class XLinkKaiConnection;
+
+namespace Engine_Constants
+{
+    // Time between attempts to reach XLink Kai and the PSP when starting.
+    constexpr std::chrono::seconds cRetryDelay{10};
+}  // namespace Engine_Constants
+
+/**
+ * Owns everything that makes up the bridge and acts on the commands in SettingsModel. Commands can be posted from any
+ * thread, Run() handles them one by one and sleeps on a condition variable in between, so a stop or restart is
+ * picked up right away instead of on the next poll.
+ */
+class Engine
+{
+public:
+    /**
+     * Constructs the engine, nothing gets started until a StartEngine command comes in.
+     * @param aSettingsModel - Settings to start the bridge with, reloaded from aConfigPath on a restart.
+     * @param aProgramPath - Directory files from the settings are relative to.
+     * @param aConfigPath - The config file.
+     */
+    Engine(SettingsModel& aSettingsModel, std::string_view aProgramPath, std::string_view aConfigPath);
+    ~Engine();
+    Engine(const Engine& aEngine) = delete;
+    Engine& operator=(const Engine& aEngine) = delete;
+
+    /**
+     * Handles commands until Quit() is called, then stops the bridge.
+     */
+    void Run();
+
+    /**
+     * Queues a command for Run() to handle.
+     * @param aCommand - The command.
+     */
+    void PostCommand(SettingsModel_Constants::Command aCommand);
+
+    /**
+     * Makes Run() stop the bridge and return.
+     */
+    void Quit();
+
+    /**
+     * Makes Run() log the flow tables of every PSP.
+     */
+    void RequestFlowLog();
+
+private:
+    /**
+     * Handles a single command, called from Run() without the lock held.
+     * @param aCommand - The command.
+     */
+    void HandleCommand(SettingsModel_Constants::Command aCommand);
+
+    /**
+     * Connects to XLink Kai and the PSPs and starts the bridge. Connections that succeed are kept for the next attempt.
+     * @return true if the bridge is running.
+     */
+    bool Start();
+
+    /**
+     * Stops the bridge and throws away everything Start() created.
+     */
+    void Stop();
+
+    /**
+     * Stops the bridge, reloads the config and starts it again, logging how long that took.
+     */
+    void Restart();
+
+    /**
+     * Creates the connections according to the current settings.
+     */
+    void CreateComponents();
+
+    /**
+     * Wires the connections together and starts their threads.
+     * @return true if successful.
+     */
+    bool StartComponents();
+
+    SettingsModel& mSettingsModel;
+    std::string    mProgramPath{};
+    std::string    mConfigPath{};
+
+    std::mutex                                   mMutex{};
+    std::condition_variable                      mCondition{};
+    std::queue<SettingsModel_Constants::Command> mCommands{};
+    bool                                         mQuit{false};
+    bool                                         mLogFlows{false};
+
+    // Only touched by the thread in Run().
+    bool                                  mStartPending{false};
+    std::chrono::steady_clock::time_point mNextAttempt{};
+    bool                                  mXLinkKaiOpen{false};
+    bool                                  mUSBOpen{false};
+
+    std::shared_ptr<XLinkKaiConnection>     mXLinkKaiConnection{nullptr};
+    std::shared_ptr<LocalSwitch>            mLocalSwitch{nullptr};
+    std::vector<std::shared_ptr<USBReader>> mUSBReaderConnections{};
+    std::shared_ptr<PacketFilter>           mFilterToPSP{nullptr};
+    std::shared_ptr<PacketFilter>           mFilterFromPSP{nullptr};
+    std::shared_ptr<DebugPrintLane>         mDebugPrintLane{nullptr};
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - FlowTable.h
+ *
+ * This file contains the header for a FlowTable class which keeps statistics per flow of frames.
+ *
+ **/
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace FlowTable_Constants
+{
+    // Amount of flows tracked, a lobby rarely has more than 16 players so this leaves plenty of room.
+    constexpr std::size_t cMaxFlows{256};
+    // Slots looked at before giving up on finding a place for a flow.
+    constexpr std::size_t cMaxProbes{16};
+}  // namespace FlowTable_Constants
+
+/**
+ * Statistics of a single flow, as read from the table.
+ */
+struct FlowRecord
+{
+    uint64_t                 source{0};
+    uint64_t                 destination{0};
+    uint16_t                 etherType{0};
+    uint64_t                 packets{0};
+    uint64_t                 bytes{0};
+    std::chrono::nanoseconds lastSeen{0};
+    // Average deviation of the time between frames, as in RFC 3550.
+    std::chrono::nanoseconds jitter{0};
+};
+
+/**
+ * Fixed size table of flows, keyed by source address, destination address and EtherType. Keeps counts, when the flow
+ * was last seen and how much the time between its frames varies.
+ * Update() may only be called by one thread at a time, Snapshot() can be called from any thread at any time without
+ * holding up Update(), every entry is protected by a sequence lock.
+ */
+class FlowTable
+{
+public:
+    /**
+     * Accounts a frame.
+     * @param aFrame - 802.3 frame.
+     */
+    void Update(std::string_view aFrame);
+
+    /**
+     * Reads all flows.
+     * @return Consistent copy of every flow in the table.
+     */
+    [[nodiscard]] std::vector<FlowRecord> Snapshot() const;
+
+    /**
+     * @return Amount of frames not accounted because the table was full.
+     */
+    [[nodiscard]] uint64_t GetOverflowCount() const;
+
+    /**
+     * Formats the flows in the table for the log.
+     * @param aName - Name of the table.
+     * @return The formatted table.
+     */
+    [[nodiscard]] std::string ToString(std::string_view aName) const;
+
+private:
+    struct Entry
+    {
+        // Odd while the entry is being written.
+        std::atomic<uint32_t> sequence{0};
+        std::atomic<bool>     used{false};
+        std::atomic<uint64_t> source{0};
+        std::atomic<uint64_t> destination{0};
+        std::atomic<uint16_t> etherType{0};
+        std::atomic<uint64_t> packets{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<int64_t>  lastSeen{0};
+        std::atomic<int64_t>  jitter{0};
+        // Only used by the writer.
+        int64_t interArrival{0};
+    };
+
+    std::array<Entry, FlowTable_Constants::cMaxFlows> mEntries{};
+    std::atomic<uint64_t>                             mOverflowCount{0};
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - HostFSServer.h
+ *
+ * This file contains the header for a HostFSServer class which serves a directory to the PSP over HostFS.
+ *
+ **/
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "USBConstants.h"
+
+namespace HostFSServer_Constants
+{
+    // File data goes over USB in pieces of this size, so frames for the game can go in between.
+    constexpr int cChunkSize{static_cast<int>(USB_Constants::cMaxUSBReadBufferSize)};
+    // Biggest single read or write we accept, same as PSPLink.
+    constexpr int         cMaxTransferSize{64 * 1024};
+    constexpr int         cMaxPathLength{1024};
+    constexpr std::size_t cMaxOpenFiles{32};
+
+    // Errors as the PSP knows them.
+    constexpr int32_t cErrorNoEntry{static_cast<int32_t>(0x80010002)};
+    constexpr int32_t cErrorBadFile{static_cast<int32_t>(0x80010009)};
+    constexpr int32_t cErrorAccess{static_cast<int32_t>(0x8001000D)};
+    constexpr int32_t cErrorTooManyFiles{static_cast<int32_t>(0x80010018)};
+
+    // Open flags used by the PSP.
+    constexpr uint32_t cOpenRead{0x0001};
+    constexpr uint32_t cOpenWrite{0x0002};
+    constexpr uint32_t cOpenAppend{0x0100};
+    constexpr uint32_t cOpenCreate{0x0200};
+    constexpr uint32_t cOpenTruncate{0x0400};
+
+    // Mode and attribute bits in a directory entry.
+    constexpr int32_t  cModeDirectory{0x1000};
+    constexpr int32_t  cModeFile{0x2000};
+    constexpr int32_t  cModeAccess{0x01FF};
+    constexpr uint32_t cAttributeDirectory{0x10};
+    constexpr uint32_t cAttributeFile{0x20};
+
+    PACK(struct PspDateTime {
+        uint16_t year;
+        uint16_t month;
+        uint16_t day;
+        uint16_t hour;
+        uint16_t minute;
+        uint16_t second;
+        uint32_t microsecond;
+    });
+
+    PACK(struct PspIoStat {
+        int32_t     mode;
+        uint32_t    attr;
+        int64_t     size;
+        PspDateTime ctime;
+        PspDateTime atime;
+        PspDateTime mtime;
+        uint32_t    reserved[6];
+    });
+
+    PACK(struct PspIoDirent {
+        PspIoStat stat;
+        char      name[256];
+        uint32_t  reserved;
+        int32_t   dummy;
+    });
+}  // namespace HostFSServer_Constants
+
+/**
+ * Answers the HostFS commands of PSPLink, so the PSP can open, read, write and list files in a directory on this
+ * machine over the same USB link as the ad-hoc traffic. Runs on the USB thread, large transfers are cut in chunks and
+ * pending frames for the PSP get sent between them, so games hardly notice.
+ */
+class HostFSServer
+{
+public:
+    /** Reads from the PSP into aData, returns the amount of bytes read or a negative value on error. **/
+    using ReadFunction = std::function<int(char* aData, int aSize)>;
+    /** Writes aData to the PSP, returns the amount of bytes written or a negative value on error. **/
+    using WriteFunction = std::function<int(char* aData, int aSize)>;
+    /** Gives frames for the PSP a chance to go out. **/
+    using YieldFunction = std::function<void()>;
+
+    /**
+     * Sets how to talk to the PSP.
+     * @param aRead - Reads data following a command.
+     * @param aWrite - Writes replies.
+     * @param aYield - Called between chunks.
+     */
+    void SetTransport(ReadFunction aRead, WriteFunction aWrite, YieldFunction aYield);
+
+    /**
+     * Sets the directory to serve, nothing gets served without one.
+     * @param aRoot - The directory.
+     * @return true if the directory exists.
+     */
+    bool SetRoot(const std::filesystem::path& aRoot);
+
+    /**
+     * @return true if there is a directory to serve.
+     */
+    [[nodiscard]] bool IsEnabled() const;
+
+    /**
+     * Handles a HostFS command from the PSP and replies to it.
+     * @param aData - The command.
+     * @return false if the PSP could not be talked to, true otherwise, also when the command failed.
+     */
+    bool HandleCommand(std::string_view aData);
+
+    /**
+     * Closes all files and directories, for example because the PSP went away.
+     */
+    void Reset();
+
+    /**
+     * Logs how fast files went over and how long frames for the PSP had to wait at most because of it.
+     */
+    void LogStatistics() const;
+
+private:
+    /**
+     * Reads the data following a command, in chunks.
+     * @param aSize - Amount of bytes to read.
+     * @param aData - Where to put it.
+     * @return true if successful.
+     */
+    bool ReadExtra(uint32_t aSize, std::vector<char>& aData);
+
+    /**
+     * Writes data to the PSP in chunks, letting frames out in between.
+     * @param aData - The data.
+     * @param aSize - Amount of bytes.
+     * @return true if successful.
+     */
+    bool WriteChunked(char* aData, int aSize);
+
+    /**
+     * Writes a reply to the PSP.
+     * @param aCommand - The command to reply to.
+     * @param aResult - The result.
+     * @param aExtraLength - Amount of bytes following the reply.
+     * @return true if successful.
+     */
+    bool Reply(uint32_t aCommand, int32_t aResult, uint32_t aExtraLength = 0);
+
+    /**
+     * Lets frames for the PSP out, and keeps track of how long they had to wait.
+     */
+    void Yield();
+
+    /**
+     * Turns a path from the PSP into a path in the served directory.
+     * @param aPath - Path from the PSP, e.g. "host0:/SAVEDATA/file.bin".
+     * @param aResult - The resulting path.
+     * @return false if the path tries to get out of the served directory.
+     */
+    bool ResolvePath(std::string_view aPath, std::filesystem::path& aResult) const;
+
+    bool HandleOpen(std::string_view aData);
+    bool HandleClose(std::string_view aData);
+    bool HandleRead(std::string_view aData);
+    bool HandleWrite(std::string_view aData);
+    bool HandleLseek(std::string_view aData);
+    bool HandleDOpen(std::string_view aData);
+    bool HandleDRead(std::string_view aData);
+    bool HandleDClose(std::string_view aData);
+
+    ReadFunction  mRead{nullptr};
+    WriteFunction mWrite{nullptr};
+    YieldFunction mYield{nullptr};
+
+    std::filesystem::path                                     mRoot{};
+    int32_t                                                   mNextId{1};
+    std::map<int32_t, std::unique_ptr<std::fstream>>          mFiles{};
+    std::map<int32_t, std::filesystem::directory_iterator>    mDirectories{};
+    std::vector<char>                                         mBuffer{};
+
+    uint64_t                              mBytesRead{0};
+    uint64_t                              mBytesWritten{0};
+    std::chrono::nanoseconds              mTransferTime{0};
+    std::chrono::steady_clock::time_point mLastYield{};
+    std::chrono::nanoseconds              mLongestStall{0};
+};
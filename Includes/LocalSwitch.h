@@ -0,0 +1,77 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - LocalSwitch.h
+ *
+ * This file contains the header for a LocalSwitch class which switches frames between PSPs on the same machine.
+ *
+ **/
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class USBReader;
+class XLinkKaiConnection;
+
+/**
+ * Sits between the PSPs attached to this machine and XLink Kai. Learns which PSP uses which MAC address, so unicast
+ * frames between local PSPs are handed over directly instead of taking a round trip through XLink Kai. Broadcast and
+ * multicast frames go to the other local PSPs and to XLink Kai.
+ */
+class LocalSwitch
+{
+public:
+    /**
+     * Constructor for LocalSwitch.
+     * @param aConnection - XLink Kai, where frames go that are not for a local PSP.
+     */
+    explicit LocalSwitch(std::shared_ptr<XLinkKaiConnection> aConnection);
+
+    /**
+     * Adds a local PSP, must be called before any of the PSPs start receiving.
+     * @param aDevice - The PSP to add.
+     */
+    void AddDevice(std::shared_ptr<USBReader> aDevice);
+
+    /**
+     * Forwards a frame from a local PSP, can be called from multiple threads.
+     * @param aSource - The PSP the frame came from.
+     * @param aData - 802.3 frame to forward.
+     */
+    void Send(USBReader& aSource, std::string_view aData);
+
+    /**
+     * Checks if frames from a PSP can go anywhere, so they can be dropped before doing any work on them if not.
+     * @return true if XLink Kai is connected or there are other local PSPs.
+     */
+    [[nodiscard]] bool IsForwarding() const;
+
+    /**
+     * @return XLink Kai connection behind this switch.
+     */
+    [[nodiscard]] XLinkKaiConnection& GetConnection() const;
+
+    /**
+     * Logs how many frames got switched locally and how long that took compared to XLink Kai.
+     */
+    void LogStatistics() const;
+
+private:
+    std::shared_ptr<XLinkKaiConnection>     mConnection{nullptr};
+    std::vector<std::shared_ptr<USBReader>> mDevices{};
+
+    mutable std::mutex                       mMutex{};
+    std::unordered_map<uint64_t, USBReader*> mMacTable{};
+
+    std::atomic<uint64_t> mLocalFrames{0};
+    std::atomic<uint64_t> mRemoteFrames{0};
+    // Frames for XLink Kai while it was not connected.
+    std::atomic<uint64_t> mDroppedFrames{0};
+    // Average time it takes to hand a frame to another local PSP, in nanoseconds, guarded by mMutex.
+    double mLocalHopTime{0};
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - MacFilter.h
+ *
+ * This file contains the header for a MacFilter class which filters out frames not meant for the PSP.
+ *
+ **/
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+namespace MacFilter_Constants
+{
+    // A PSP only uses its own address, some room for plugins or switching PSPs on the same cable.
+    constexpr std::size_t cMaxLearnedMacs{4};
+}  // namespace MacFilter_Constants
+
+/**
+ * Learns the MAC addresses the PSP sends from, and lets through only frames to those addresses plus broadcast and
+ * multicast, so unicast traffic for other players does not have to cross USB. Lets everything through until the
+ * first address is learned.
+ * Learn() may only be called from one thread, ShouldForward() from any.
+ */
+class MacFilter
+{
+public:
+    /**
+     * Learns the source address of a frame the PSP sent.
+     * @param aFrame - 802.3 frame from the PSP.
+     */
+    void Learn(std::string_view aFrame);
+
+    /**
+     * Forgets all learned addresses, for example because the PSP got reset.
+     */
+    void Clear();
+
+    /**
+     * Checks if a frame should be sent to the PSP.
+     * @param aFrame - 802.3 frame meant for the PSP.
+     * @return true if the frame should be sent.
+     */
+    bool ShouldForward(std::string_view aFrame);
+
+    /**
+     * @return Amount of frames let through.
+     */
+    [[nodiscard]] uint64_t GetForwardedCount() const;
+
+    /**
+     * @return Amount of frames filtered out.
+     */
+    [[nodiscard]] uint64_t GetFilteredCount() const;
+
+private:
+    std::array<std::atomic<uint64_t>, MacFilter_Constants::cMaxLearnedMacs> mMacs{};
+    std::atomic<std::size_t>                                               mMacCount{0};
+    std::size_t                                                            mNextSlot{0};
+
+    std::atomic<uint64_t> mForwardedCount{0};
+    std::atomic<uint64_t> mFilteredCount{0};
+};
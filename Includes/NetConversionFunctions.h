@@ -39,7 +39,10 @@
  */
 template<typename Type> static Type GetRawData(std::string_view aPacket, unsigned int aIndex)
 {
-    return (*reinterpret_cast<const Type*>(aPacket.data() + aIndex));
+    // memcpy instead of a cast, the data is not necessarily aligned, this still compiles down to a single move
+    Type lReturn;
+    std::memcpy(&lReturn, aPacket.data() + aIndex, sizeof(Type));
+    return lReturn;
 }
 
 /**
@@ -63,6 +66,46 @@ static uint64_t SwapMacEndian(uint64_t aMac)
     return aMac >> 16U;
 }
 
+/**
+ * Reads a MAC address from a packet as a number, first octet in the highest byte.
+ * @param aPacket - Packet to read from, needs 8 bytes from aIndex on.
+ * @param aIndex - Where the address starts.
+ * @return The address.
+ */
+static inline uint64_t GetMacAddress(std::string_view aPacket, unsigned int aIndex)
+{
+    // Reading it as 8 bytes takes two bytes of whatever comes after it, mask those off
+    return SwapMacEndian(GetRawData<uint64_t>(aPacket, aIndex)) & 0xFFFFFFFFFFFFU;
+}
+
+/**
+ * Checks if a MAC address is a broadcast or multicast address.
+ * @param aMac - Address as returned by GetMacAddress.
+ * @return true if it is.
+ */
+static inline bool IsGroupAddress(uint64_t aMac)
+{
+    // Lowest bit of the first octet
+    return (aMac & 0x010000000000U) != 0;
+}
+
+/**
+ * Converts a MAC address to the usual notation.
+ * @param aMac - Address as returned by GetMacAddress.
+ * @return The address as string, e.g. 00:01:4a:12:34:56.
+ */
+static inline std::string MacToString(uint64_t aMac)
+{
+    std::stringstream lFormattedString;
+    for (int lOctet = 5; lOctet >= 0; lOctet--) {
+        lFormattedString << std::hex << std::setfill('0') << std::setw(2) << ((aMac >> (lOctet * 8)) & 0xFF);
+        if (lOctet > 0) {
+            lFormattedString << ":";
+        }
+    }
+    return lFormattedString.str();
+}
+
 /**
  * Converts string to a pretty hex string for easy reading.
  * @param aData - Data to prettify.
@@ -0,0 +1,142 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - PacketFilter.h
+ *
+ * This file contains the header for a PacketFilter class which matches frames against rules set by the user.
+ *
+ **/
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace PacketFilter_Constants
+{
+    /**
+     * What to do with a frame that matches a rule.
+     */
+    enum class Action
+    {
+        Drop = 0,
+        Count,
+        Tag
+    };
+
+    static constexpr std::array<std::string_view, 3> cActionTexts{"drop", "count", "tag"};
+
+    static constexpr std::string_view cRuleSeparator{";"};
+    static constexpr std::string_view cConditionSeparator{"&"};
+    static constexpr std::string_view cActionSeparator{"->"};
+}  // namespace PacketFilter_Constants
+
+/**
+ * Filters frames using rules that get compiled once into a flat table of byte compares, so matching a frame is just a
+ * couple of loads and compares per rule. The first rule that matches decides what happens to a frame: drop it, count
+ * it or tag it, tagged frames are written to a capture file if one is set. Frames not matching any rule pass.
+ *
+ * Rules are separated by ';' and look like condition&condition->action, without spaces, conditions can be:
+ *  ethertype=86dd     - EtherType in hex.
+ *  src=01:80:c2:00:00:0e, dst=... - Source or destination address.
+ *  len<100, len>1400, len=60 - Length of the frame.
+ *  @14=4500           - Bytes in hex at the given offset.
+ *  any                - Every frame.
+ * For example: "ethertype=86dd->drop;dst=01:80:c2:00:00:0e->drop;len>1400->count".
+ *
+ * Can be used from multiple threads at the same time once compiled.
+ */
+class PacketFilter
+{
+public:
+    /**
+     * Compiles rules, replaces the rules compiled before.
+     * @param aRules - The rules.
+     * @return true if all rules could be compiled, if not no rules are used.
+     */
+    bool Compile(std::string_view aRules);
+
+    /**
+     * Sets the file tagged frames get written to, in pcap format.
+     * @param aPath - Path of the file, empty to not capture.
+     * @return true if the file could be opened.
+     */
+    bool SetCaptureFile(const std::string& aPath);
+
+    /**
+     * Checks if a frame should be forwarded.
+     * @param aFrame - 802.3 frame.
+     * @return true if it should be forwarded.
+     */
+    bool ShouldForward(std::string_view aFrame);
+
+    /**
+     * Filters a batch of frames, moving the ones that should be forwarded to the front in the same order.
+     * @param aFrames - The frames.
+     * @return Amount of frames that should be forwarded.
+     */
+    std::size_t Filter(std::span<std::string_view> aFrames);
+
+    /**
+     * @return true if there are any rules.
+     */
+    [[nodiscard]] bool IsEmpty() const;
+
+    /**
+     * Logs how often every rule matched.
+     * @param aName - Name of the filter.
+     */
+    void LogStatistics(std::string_view aName) const;
+
+private:
+    // Up to 8 bytes at an offset, compared in one go.
+    struct Test
+    {
+        uint16_t offset{0};
+        uint8_t  length{0};
+        uint64_t value{0};
+    };
+
+    struct Rule
+    {
+        std::size_t                    firstTest{0};
+        std::size_t                    testCount{0};
+        std::size_t                    minLength{0};
+        std::size_t                    maxLength{SIZE_MAX};
+        PacketFilter_Constants::Action action{PacketFilter_Constants::Action::Drop};
+        std::string                    text{};
+    };
+
+    /**
+     * Compiles a single condition into the rule.
+     * @param aCondition - The condition.
+     * @param aRule - Rule to add it to.
+     * @return true if successful.
+     */
+    bool CompileCondition(std::string_view aCondition, Rule& aRule);
+
+    /**
+     * Adds tests comparing the given bytes at the given offset to the rule.
+     * @param aOffset - Offset in the frame.
+     * @param aBytes - Bytes to compare with.
+     * @param aRule - Rule to add them to.
+     */
+    void AddTests(std::size_t aOffset, std::string_view aBytes, Rule& aRule);
+
+    /**
+     * Writes a frame to the capture file.
+     * @param aFrame - The frame.
+     */
+    void Capture(std::string_view aFrame);
+
+    std::vector<Test>                           mTests{};
+    std::vector<Rule>                           mRules{};
+    std::unique_ptr<std::atomic<uint64_t>[]>    mMatches{nullptr};
+    std::mutex                                  mCaptureMutex{};
+    std::ofstream                               mCaptureFile{};
+};
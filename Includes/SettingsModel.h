@@ -21,21 +21,51 @@ namespace SettingsModel_Constants
     static constexpr std::string_view cSaveChannel{"Channel"};
     static constexpr std::string_view cSaveXLinkIp{"XLinkIp"};
     static constexpr std::string_view cSaveXLinkPort{"XLinkPort"};
+    static constexpr std::string_view cSaveXLinkFallbacks{"XLinkFallbacks"};
+    static constexpr std::string_view cSaveXLinkFailoverTimeoutMS{"XLinkFailoverTimeoutMS"};
     static constexpr std::string_view cSaveMaxBufferedMessages{"MaxBuffer"};
     static constexpr std::string_view cSaveMaxFatalRetries{"MaxRetriesAfterFatalError"};
     static constexpr std::string_view cSaveMaxReadWriteRetries{"MaxRetriesWhenReadWriteFailed"};
     static constexpr std::string_view cSaveReadTimeOutMS{"MaxReadTimeoutMS"};
     static constexpr std::string_view cSaveWriteTimeOutMS{"MaxWriteTimeoutMS"};
+    static constexpr std::string_view cSaveUSBPacing{"USBPacing"};
+    static constexpr std::string_view cSaveUSBSendScheduler{"USBSendScheduler"};
+    static constexpr std::string_view cSaveUSBSmallFrameThreshold{"USBSmallFrameThreshold"};
+    static constexpr std::string_view cSaveUSBMacFilter{"USBMacFilter"};
+    static constexpr std::string_view cSaveBroadcastRateLimit{"BroadcastRateLimit"};
+    static constexpr std::string_view cSaveDuplicateWindowMS{"DuplicateWindowMS"};
+    static constexpr std::string_view cSaveMaxPSPs{"MaxPSPs"};
+    static constexpr std::string_view cSaveFilterToPSP{"FilterToPSP"};
+    static constexpr std::string_view cSaveFilterFromPSP{"FilterFromPSP"};
+    static constexpr std::string_view cSaveFilterCaptureFile{"FilterCaptureFile"};
+    static constexpr std::string_view cSavePSPDebugLog{"PSPDebugLog"};
+    static constexpr std::string_view cSaveHostFSRoot{"HostFSRoot"};
+    static constexpr std::string_view cSaveUSBAggregation{"USBAggregation"};
 
     static constexpr Logger::Level    cDefaultLogLevel{Logger::Level::INFO};
     static constexpr bool             cDefaultAutoDiscoverXLinkKai{false};
     static constexpr std::string_view cDefaultXLinkIp{"127.0.0.1"};
     static constexpr std::string_view cDefaultXLinkPort{"34523"};
+    static constexpr std::string_view cDefaultXLinkFallbacks{""};
+    static constexpr int              cDefaultXLinkFailoverTimeoutMS{5000};
     static constexpr int              cDefaultMaxBufferedMessages{1000};
     static constexpr int              cDefaultMaxFatalRetries{5000};
     static constexpr int              cDefaultMaxReadWriteRetries{5000};
     static constexpr int              cDefaultReadTimeOutMS{2};
     static constexpr int              cDefaultWriteTimeOutMS{2};
+    static constexpr bool             cDefaultUSBPacing{true};
+    static constexpr std::string_view cDefaultUSBSendScheduler{"DeficitRoundRobin"};
+    static constexpr int              cDefaultUSBSmallFrameThreshold{512};
+    static constexpr bool             cDefaultUSBMacFilter{true};
+    static constexpr int              cDefaultBroadcastRateLimit{100};
+    static constexpr int              cDefaultDuplicateWindowMS{0};
+    static constexpr int              cDefaultMaxPSPs{1};
+    static constexpr std::string_view cDefaultFilterToPSP{""};
+    static constexpr std::string_view cDefaultFilterFromPSP{""};
+    static constexpr std::string_view cDefaultFilterCaptureFile{""};
+    static constexpr std::string_view cDefaultPSPDebugLog{""};
+    static constexpr std::string_view cDefaultHostFSRoot{""};
+    static constexpr bool             cDefaultUSBAggregation{true};
 
     enum class EngineStatus
     {
@@ -50,6 +80,7 @@ namespace SettingsModel_Constants
     {
         StartEngine = 0,
         StopEngine,
+        RestartEngine,
         SaveSettings,
         NoCommand
     };
@@ -61,13 +92,29 @@ public:
     // Settings
     Logger::Level mLogLevel{SettingsModel_Constants::cDefaultLogLevel};
 
+    bool        mAutoDiscoverXLinkKai{SettingsModel_Constants::cDefaultAutoDiscoverXLinkKai};
     std::string mXLinkIp{SettingsModel_Constants::cDefaultXLinkIp};
     std::string mXLinkPort{SettingsModel_Constants::cDefaultXLinkPort};
+    std::string mXLinkFallbacks{SettingsModel_Constants::cDefaultXLinkFallbacks};
+    int         mXLinkFailoverTimeoutMS{SettingsModel_Constants::cDefaultXLinkFailoverTimeoutMS};
     int         mMaxBufferedMessages{SettingsModel_Constants::cDefaultMaxBufferedMessages};
     int         mMaxFatalRetries{SettingsModel_Constants::cDefaultMaxFatalRetries};
     int         mMaxReadWriteRetries{SettingsModel_Constants::cDefaultMaxReadWriteRetries};
     int         mReadTimeOutMS{SettingsModel_Constants::cDefaultReadTimeOutMS};
     int         mWriteTimeOutMS{SettingsModel_Constants::cDefaultWriteTimeOutMS};
+    bool        mUSBPacing{SettingsModel_Constants::cDefaultUSBPacing};
+    std::string mUSBSendScheduler{SettingsModel_Constants::cDefaultUSBSendScheduler};
+    int         mUSBSmallFrameThreshold{SettingsModel_Constants::cDefaultUSBSmallFrameThreshold};
+    bool        mUSBMacFilter{SettingsModel_Constants::cDefaultUSBMacFilter};
+    int         mBroadcastRateLimit{SettingsModel_Constants::cDefaultBroadcastRateLimit};
+    int         mDuplicateWindowMS{SettingsModel_Constants::cDefaultDuplicateWindowMS};
+    int         mMaxPSPs{SettingsModel_Constants::cDefaultMaxPSPs};
+    std::string mFilterToPSP{SettingsModel_Constants::cDefaultFilterToPSP};
+    std::string mFilterFromPSP{SettingsModel_Constants::cDefaultFilterFromPSP};
+    std::string mFilterCaptureFile{SettingsModel_Constants::cDefaultFilterCaptureFile};
+    std::string mPSPDebugLog{SettingsModel_Constants::cDefaultPSPDebugLog};
+    std::string mHostFSRoot{SettingsModel_Constants::cDefaultHostFSRoot};
+    bool        mUSBAggregation{SettingsModel_Constants::cDefaultUSBAggregation};
 
     // Statuses
     SettingsModel_Constants::EngineStatus mEngineStatus{SettingsModel_Constants::EngineStatus::Idle};
@@ -0,0 +1,98 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - StormFilter.h
+ *
+ * This file contains the header for a StormFilter class which keeps broadcast storms and duplicate frames away from
+ * the PSP.
+ *
+ **/
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+
+#include "TokenBucket.h"
+
+namespace StormFilter_Constants
+{
+    // Broadcast and multicast frames per second allowed from a single source, 0 to not limit.
+    constexpr int cDefaultBroadcastRate{100};
+    // Same frame within this time counts as a duplicate, 0 to not check.
+    constexpr int cDefaultDuplicateWindowMS{0};
+    // Amount of recent frames remembered to check for duplicates.
+    constexpr std::size_t cDuplicateHistorySize{64};
+    // Sources tracked before starting over, so the table cannot grow without bounds.
+    constexpr std::size_t cMaxTrackedSources{256};
+}  // namespace StormFilter_Constants
+
+/**
+ * Limits the rate of broadcast and multicast frames per source address and drops exact duplicates of frames seen
+ * shortly before, so a single noisy peer cannot fill up the USB link. Not thread safe, frames come from XLink Kai and
+ * from other PSPs through LocalSwitch, so callers serialize access (USBReader does so with its send mutex).
+ */
+class StormFilter
+{
+public:
+    /**
+     * Sets the thresholds.
+     * @param aBroadcastRate - Broadcast and multicast frames per second allowed per source, 0 to not limit.
+     * @param aDuplicateWindowMS - Same frame within this time counts as a duplicate, 0 to not check.
+     */
+    void SetThresholds(int aBroadcastRate, int aDuplicateWindowMS);
+
+    /**
+     * Checks if a frame should be sent to the PSP.
+     * @param aFrame - 802.3 frame meant for the PSP.
+     * @return true if the frame should be sent.
+     */
+    bool ShouldForward(std::string_view aFrame);
+
+    /**
+     * @return Amount of broadcast and multicast frames dropped because their source sent too many.
+     */
+    [[nodiscard]] uint64_t GetRateLimitedCount() const;
+
+    /**
+     * @return Amount of frames dropped because they were duplicates.
+     */
+    [[nodiscard]] uint64_t GetDuplicateCount() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * Checks if a broadcast or multicast frame is within the rate of its source.
+     * @param aSource - Source address of the frame.
+     * @param aNow - Current time.
+     * @return true if within the rate.
+     */
+    bool IsWithinRate(uint64_t aSource, Clock::time_point aNow);
+
+    /**
+     * Checks if a frame was seen shortly before, remembers it otherwise.
+     * @param aFrame - The frame.
+     * @param aNow - Current time.
+     * @return true if it is a duplicate.
+     */
+    bool IsDuplicate(std::string_view aFrame, Clock::time_point aNow);
+
+    struct SeenFrame
+    {
+        uint64_t          hash{0};
+        std::size_t       length{0};
+        Clock::time_point time{};
+    };
+
+    int                       mBroadcastRate{StormFilter_Constants::cDefaultBroadcastRate};
+    std::chrono::milliseconds mDuplicateWindow{StormFilter_Constants::cDefaultDuplicateWindowMS};
+
+    std::unordered_map<uint64_t, TokenBucket>                        mSources{};
+    std::array<SeenFrame, StormFilter_Constants::cDuplicateHistorySize> mSeenFrames{};
+    std::size_t                                                         mNextSeenFrame{0};
+
+    std::atomic<uint64_t> mRateLimitedCount{0};
+    std::atomic<uint64_t> mDuplicateCount{0};
+};
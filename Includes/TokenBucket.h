@@ -0,0 +1,58 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - TokenBucket.h
+ *
+ * This file contains the header for a TokenBucket class which can be used to limit the rate of something.
+ *
+ **/
+
+#include <chrono>
+
+/**
+ * Classic token bucket, tokens come in at a fixed rate up to a maximum, consuming is only allowed when there are
+ * enough tokens. Not thread safe.
+ */
+class TokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * Constructor for TokenBucket, starts full.
+     * @param aRate - Tokens per second, 0 for unlimited.
+     * @param aBurst - Maximum amount of tokens in the bucket.
+     */
+    TokenBucket(double aRate, double aBurst);
+
+    /**
+     * Takes tokens out of the bucket if there are enough.
+     * @param aAmount - Amount of tokens to take.
+     * @param aNow - Current time.
+     * @return true if the tokens were taken.
+     */
+    bool TryConsume(double aAmount, Clock::time_point aNow = Clock::now());
+
+    /**
+     * Sets the rate tokens come in with, tokens already in the bucket stay.
+     * @param aRate - Tokens per second, 0 for unlimited.
+     */
+    void SetRate(double aRate);
+
+    /**
+     * @return Tokens per second, 0 when unlimited.
+     */
+    [[nodiscard]] double GetRate() const;
+
+    /**
+     * @return true if the bucket does not limit anything.
+     */
+    [[nodiscard]] bool IsUnlimited() const;
+
+private:
+    void Refill(Clock::time_point aNow);
+
+    double            mRate{0};
+    double            mBurst{0};
+    double            mTokens{0};
+    Clock::time_point mLastRefill{Clock::now()};
+};
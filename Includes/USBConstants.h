@@ -53,11 +53,22 @@ namespace USB_Constants
 
     constexpr unsigned int cMaxUSBPacketSize{512};
 
+    // Reads ask for several USB packets at once, the PSP ends the transfer early with a short packet at the end of a
+    // frame. Has to be a multiple of cMaxUSBPacketSize.
+    constexpr unsigned int cMaxUSBReadBufferSize{cMaxUSBPacketSize * 8};
+
     constexpr unsigned int cMaxUSBHelloTimeout{1000};
+    // Replies to HostFS commands can be a lot bigger than a hello, give them some more time.
+    constexpr unsigned int cMaxUSBHostFSTimeout{2000};
+
+    // Attempts without progress a frame for the PSP gets before it is dropped.
+    constexpr int cMaxFrameWriteRetries{3};
 
     constexpr unsigned int cUSBDataReadEndpoint{0x81};
     constexpr unsigned int cUSBDataWriteEndpoint{0x3};
     constexpr unsigned int cUSBHelloEndpoint{0x2};
+    // HostFS replies go where the hello goes.
+    constexpr unsigned int cUSBHostFSWriteEndpoint{cUSBHelloEndpoint};
 
     // The maximum 802.11 MTU is 2304 bytes. 802.11-2012, page 413, section 8.3.2.1
     constexpr int cMaxAsynchronousBuffer{2304};
@@ -72,7 +83,16 @@ namespace USB_Constants
 
     enum HostFsCommands
     {
-        Hello = (0x8FFCU << 16U) | cAdhocRedirectorVersion,
+        Hello        = (0x8FFCU << 16U) | cAdhocRedirectorVersion,
+        HostFsBye    = 0x8FFC0001,
+        HostFsOpen   = 0x8FFC0002,
+        HostFsClose  = 0x8FFC0003,
+        HostFsRead   = 0x8FFC0004,
+        HostFsWrite  = 0x8FFC0005,
+        HostFsLseek  = 0x8FFC0006,
+        HostFsDOpen  = 0x8FFC000A,
+        HostFsDRead  = 0x8FFC000B,
+        HostFsDClose = 0x8FFC000C,
     };
 
     enum AsyncCommands
@@ -81,20 +101,6 @@ namespace USB_Constants
         Packet = 2
     };
 
-    struct BinaryStitchWiFiPacket
-    {
-        std::array<char, cMaxAsynchronousBuffer> data;
-        uint16_t                                 length;
-        bool                                     stitch;
-    };
-
-    struct BinaryStitchUSBPacket
-    {
-        std::array<char, cMaxUSBPacketSize> data;
-        uint16_t                            length;
-        bool                                stitch;
-    };
-
     struct BinaryWiFiPacket
     {
         std::array<char, cMaxAsynchronousBuffer> data;
@@ -111,6 +117,54 @@ namespace USB_Constants
 
     PACK(struct HostFsHelloResp { struct HostFsCommand cmd; });
 
+    // Hello with the capabilities of the sender appended, extralen is set to the size of the capabilities.
+    PACK(struct HostFsHelloCapabilities {
+        struct HostFsCommand cmd;
+        uint32_t             capabilities;
+    });
+
+    PACK(struct HostFsOpenCmd {
+        struct HostFsCommand cmd;
+        uint32_t             mode;
+        uint32_t             mask;
+        uint32_t             fsnum;
+    });
+
+    // Close, write, dread and dclose only carry the file or directory id.
+    PACK(struct HostFsIdCmd {
+        struct HostFsCommand cmd;
+        int32_t              fid;
+    });
+
+    PACK(struct HostFsReadCmd {
+        struct HostFsCommand cmd;
+        int32_t              fid;
+        int32_t              len;
+    });
+
+    PACK(struct HostFsLseekCmd {
+        struct HostFsCommand cmd;
+        int32_t              fid;
+        int64_t              ofs;
+        int32_t              whence;
+    });
+
+    PACK(struct HostFsDOpenCmd {
+        struct HostFsCommand cmd;
+        uint32_t             fsnum;
+    });
+
+    PACK(struct HostFsResp {
+        struct HostFsCommand cmd;
+        int32_t              res;
+    });
+
+    PACK(struct HostFsLseekResp {
+        struct HostFsCommand cmd;
+        int32_t              res;
+        int64_t              ofs;
+    });
+
     PACK(struct AsyncCommand {
         eMagicType magic;
         uint32_t   channel;
@@ -138,6 +192,38 @@ namespace USB_Constants
     constexpr unsigned int cAsyncCommandSendPacket{77};
     constexpr unsigned int cAsyncCommandPrintData{66};
     constexpr unsigned int cAsyncUserChannel{4};
+    // Ref of a packet holding several frames, each preceded by its length.
+    constexpr unsigned int cAsyncCommandSendAggregate{78};
+    constexpr unsigned int cAggregateLengthSize{sizeof(uint16_t)};
+    // Ref of an empty packet telling the PSP to throw away the frame it got halfway.
+    constexpr unsigned int cAsyncCommandAbortPacket{79};
+
+    // Capabilities exchanged in the hello, older plugins don't send any and get the plain format.
+    constexpr uint32_t cCapabilityAggregation{1U << 0U};
+    constexpr uint32_t cCapabilityAbortMarker{1U << 1U};
+    constexpr uint32_t cSupportedCapabilities{cCapabilityAggregation | cCapabilityAbortMarker};
 
     constexpr unsigned int cHostFSHeaderSize{sizeof(HostFsCommand)};
+
+    // Room for frames in an aggregate, it always fits in a single chunk.
+    constexpr unsigned int cMaxAggregatePayload{cMaxUSBPacketSize - cAsyncHeaderAndSubHeaderSize};
+
+    // A packet for the PSP is split into chunks of at most one USB packet, only the first one carries a subheader.
+    constexpr unsigned int cMaxChunksPerFrame{
+        1 + ((cMaxAsynchronousBuffer - (cMaxUSBPacketSize - cAsyncHeaderAndSubHeaderSize)) +
+             (cMaxUSBPacketSize - cAsyncHeaderSize) - 1) /
+                (cMaxUSBPacketSize - cAsyncHeaderSize)};
+
+    // Biggest a packet for the PSP can get with all its chunk headers in place.
+    constexpr unsigned int cMaxUSBFrameSize{cMaxAsynchronousBuffer + cAsyncSubHeaderSize +
+                                            (cAsyncHeaderSize * cMaxChunksPerFrame)};
+
+    /**
+     * A packet laid out exactly as it goes over USB, every chunk of cMaxUSBPacketSize starts with its own header.
+     */
+    struct USBFrame
+    {
+        std::array<char, cMaxUSBFrameSize> data;
+        uint16_t                           length;
+    };
 }  // namespace USB_Constants
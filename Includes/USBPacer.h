@@ -0,0 +1,74 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - USBPacer.h
+ *
+ * This file contains the header for a USBPacer class which paces the data we send to the PSP.
+ *
+ **/
+
+#include <chrono>
+#include <cstddef>
+
+#include "TokenBucket.h"
+#include "USBConstants.h"
+
+namespace USBPacer_Constants
+{
+    // Enough for a few full frames, so short bursts are not delayed.
+    constexpr double cBurstSize{USB_Constants::cMaxUSBFrameSize * 4};
+    // Never go slower than this, the PSP can always take this much.
+    constexpr double cMinimumRate{64 * 1024};
+    // Above this the USB bus is the limit anyway, so stop pacing.
+    constexpr double cMaximumRate{32 * 1024 * 1024};
+    // Rate goes up this much for every frame that got through without a timeout.
+    constexpr double cRateIncrease{8 * 1024};
+    // Rate gets multiplied with this on a timeout.
+    constexpr double cRateDecrease{0.5};
+    // Weight of a new measurement in the acceptance rate.
+    constexpr double cAcceptanceRateWeight{0.125};
+}  // namespace USBPacer_Constants
+
+/**
+ * Paces the data we send to the PSP to what the PSP can handle. Measures how fast the PSP takes data from how long
+ * writes take and slows down when writes start timing out, speeds up again slowly as long as they don't (AIMD).
+ * Starts out unlimited, so nothing changes until the PSP cannot keep up. Only to be used from the USB thread.
+ */
+class USBPacer
+{
+public:
+    /**
+     * Turns pacing on or off.
+     * @param aEnabled - true to turn it on.
+     */
+    void SetEnabled(bool aEnabled);
+
+    /**
+     * Checks if a frame can be sent now, takes it from the budget if so.
+     * @param aSize - Size of the frame.
+     * @return true if it can be sent.
+     */
+    bool CanSend(std::size_t aSize);
+
+    /**
+     * Lets the pacer know how a write went.
+     * @param aBytes - Amount of bytes written.
+     * @param aElapsed - How long the write took.
+     * @param aTimedOut - true if the write timed out.
+     */
+    void OnWriteComplete(std::size_t aBytes, std::chrono::steady_clock::duration aElapsed, bool aTimedOut);
+
+    /**
+     * @return Measured rate in bytes per second the PSP takes data with.
+     */
+    [[nodiscard]] double GetAcceptanceRate() const;
+
+    /**
+     * @return Rate in bytes per second data is sent with, 0 when not limited.
+     */
+    [[nodiscard]] double GetRate() const;
+
+private:
+    bool        mEnabled{true};
+    TokenBucket mBucket{0, USBPacer_Constants::cBurstSize};
+    double      mAcceptanceRate{0};
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - USBPacketViews.h
+ *
+ * This file contains zero-copy views on the headers used in the PSP USB protocol, so packets can be parsed straight
+ * from the receive buffer without casting it to the packed structs in USBConstants.h.
+ *
+ **/
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "USBConstants.h"
+
+/**
+ * Loads a value from a possibly unaligned location, compiles down to a single move.
+ * @param aData - Location to load from.
+ * @return The loaded value.
+ */
+template<typename Type> static inline Type LoadUnaligned(const char* aData)
+{
+    Type lReturn;
+    std::memcpy(&lReturn, aData, sizeof(Type));
+    return lReturn;
+}
+
+/**
+ * Stores a value on a possibly unaligned location, compiles down to a single move.
+ * @param aData - Location to store to.
+ * @param aValue - Value to store.
+ */
+template<typename Type> static inline void StoreUnaligned(char* aData, Type aValue)
+{
+    std::memcpy(aData, &aValue, sizeof(Type));
+}
+
+namespace USB_Constants
+{
+    // Offsets of the fields in HostFsCommand.
+    constexpr std::size_t cHostFsMagicOffset{0};
+    constexpr std::size_t cHostFsCommandOffset{4};
+    constexpr std::size_t cHostFsExtraLengthOffset{8};
+
+    // Offsets of the fields in AsyncCommand.
+    constexpr std::size_t cAsyncMagicOffset{0};
+    constexpr std::size_t cAsyncChannelOffset{4};
+
+    // Offsets of the fields in AsyncSubHeader, relative to the start of the subheader.
+    constexpr std::size_t cSubHeaderMagicOffset{0};
+    constexpr std::size_t cSubHeaderModeOffset{4};
+    constexpr std::size_t cSubHeaderSizeOffset{8};
+    constexpr std::size_t cSubHeaderRefOffset{12};
+
+    static_assert(cHostFsCommandOffset == offsetof(HostFsCommand, command));
+    static_assert(cHostFsExtraLengthOffset == offsetof(HostFsCommand, extralen));
+    static_assert(cAsyncChannelOffset == offsetof(AsyncCommand, channel));
+    static_assert(cSubHeaderModeOffset == offsetof(AsyncSubHeader, mode));
+    static_assert(cSubHeaderSizeOffset == offsetof(AsyncSubHeader, size));
+    static_assert(cSubHeaderRefOffset == offsetof(AsyncSubHeader, ref));
+
+    // Header in front of every chunk we send to the PSP.
+    constexpr std::array<char, cAsyncHeaderSize> cAsyncUserHeaderTemplate{
+        std::bit_cast<std::array<char, cAsyncHeaderSize>>(AsyncCommand{Asynchronous, cAsyncUserChannel})};
+
+    // Subheader in front of the first chunk of a packet we send to the PSP, size still has to be filled in. Mode 3 and
+    // ref 0 is what the PSP side expects, i don't know why.
+    constexpr std::array<char, cAsyncSubHeaderSize> cPacketSubHeaderTemplate{
+        std::bit_cast<std::array<char, cAsyncSubHeaderSize>>(AsyncSubHeader{DebugPrint, 3, 0, 0})};
+
+    // Same for a packet holding several frames, only sent when the PSP said it can handle them.
+    constexpr std::array<char, cAsyncSubHeaderSize> cAggregateSubHeaderTemplate{
+        std::bit_cast<std::array<char, cAsyncSubHeaderSize>>(
+            AsyncSubHeader{DebugPrint, 3, 0, cAsyncCommandSendAggregate})};
+
+    // Subheader of the abort marker, only sent when the PSP said it understands it.
+    constexpr std::array<char, cAsyncSubHeaderSize> cAbortSubHeaderTemplate{
+        std::bit_cast<std::array<char, cAsyncSubHeaderSize>>(
+            AsyncSubHeader{DebugPrint, 3, 0, cAsyncCommandAbortPacket})};
+}  // namespace USB_Constants
+
+/**
+ * View on a HostFS command header.
+ */
+class HostFsCommandView
+{
+public:
+    /**
+     * Creates the view, it is only valid if aData is big enough to contain the header.
+     * @param aData - Data to look at.
+     */
+    explicit HostFsCommandView(std::string_view aData) :
+        mData(aData.size() >= USB_Constants::cHostFSHeaderSize ? aData : std::string_view{})
+    {}
+
+    [[nodiscard]] bool     IsValid() const { return !mData.empty(); }
+    [[nodiscard]] uint32_t Magic() const
+    {
+        return LoadUnaligned<uint32_t>(mData.data() + USB_Constants::cHostFsMagicOffset);
+    }
+    [[nodiscard]] uint32_t Command() const
+    {
+        return LoadUnaligned<uint32_t>(mData.data() + USB_Constants::cHostFsCommandOffset);
+    }
+    [[nodiscard]] uint32_t ExtraLength() const
+    {
+        return LoadUnaligned<uint32_t>(mData.data() + USB_Constants::cHostFsExtraLengthOffset);
+    }
+
+private:
+    std::string_view mData;
+};
+
+/**
+ * View on an asynchronous command header and whatever comes after it.
+ */
+class AsyncCommandView
+{
+public:
+    /**
+     * Creates the view, it is only valid if aData is big enough to contain the header.
+     * @param aData - Data to look at.
+     */
+    explicit AsyncCommandView(std::string_view aData) :
+        mData(aData.size() >= USB_Constants::cAsyncHeaderSize ? aData : std::string_view{})
+    {}
+
+    [[nodiscard]] bool     IsValid() const { return !mData.empty(); }
+    [[nodiscard]] uint32_t Magic() const
+    {
+        return LoadUnaligned<uint32_t>(mData.data() + USB_Constants::cAsyncMagicOffset);
+    }
+    [[nodiscard]] uint32_t Channel() const
+    {
+        return LoadUnaligned<uint32_t>(mData.data() + USB_Constants::cAsyncChannelOffset);
+    }
+    /** Everything after the header. */
+    [[nodiscard]] std::string_view Payload() const { return mData.substr(USB_Constants::cAsyncHeaderSize); }
+    /** The whole packet including the header. */
+    [[nodiscard]] std::string_view Data() const { return mData; }
+
+private:
+    std::string_view mData;
+};
+
+/**
+ * View on an asynchronous subheader and whatever comes after it.
+ */
+class AsyncSubHeaderView
+{
+public:
+    /**
+     * Creates the view, it is only valid if aData is big enough to contain the subheader.
+     * @param aData - Data to look at, starting at the subheader.
+     */
+    explicit AsyncSubHeaderView(std::string_view aData) :
+        mData(aData.size() >= USB_Constants::cAsyncSubHeaderSize ? aData : std::string_view{})
+    {}
+
+    [[nodiscard]] bool     IsValid() const { return !mData.empty(); }
+    [[nodiscard]] uint32_t Magic() const
+    {
+        return LoadUnaligned<uint32_t>(mData.data() + USB_Constants::cSubHeaderMagicOffset);
+    }
+    [[nodiscard]] int32_t Mode() const
+    {
+        return LoadUnaligned<int32_t>(mData.data() + USB_Constants::cSubHeaderModeOffset);
+    }
+    [[nodiscard]] int32_t Size() const
+    {
+        return LoadUnaligned<int32_t>(mData.data() + USB_Constants::cSubHeaderSizeOffset);
+    }
+    [[nodiscard]] int32_t Ref() const
+    {
+        return LoadUnaligned<int32_t>(mData.data() + USB_Constants::cSubHeaderRefOffset);
+    }
+    /** Everything after the subheader. */
+    [[nodiscard]] std::string_view Payload() const { return mData.substr(USB_Constants::cAsyncSubHeaderSize); }
+
+private:
+    std::string_view mData;
+};
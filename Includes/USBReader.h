@@ -7,6 +7,7 @@
  * */
 
 #include <array>
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -14,12 +15,23 @@
 #include <string_view>
 #include <thread>
 
+#include "AsyncDemultiplexer.h"
+#include "FlowTable.h"
+#include "HostFSServer.h"
+#include "MacFilter.h"
+#include "StormFilter.h"
 #include "USBConstants.h"
+#include "USBPacer.h"
+#include "USBReassembler.h"
+#include "USBSendThread.h"
+#include "USBTransferMemory.h"
 
 struct libusb_device_handle;
+class AsyncCommandView;
+class AsyncSubHeaderView;
 class USBReceiveThread;
-class USBSendThread;
-class XLinkKaiConnection;
+class LocalSwitch;
+class PacketFilter;
 
 class USBReader
 {
@@ -39,7 +51,7 @@ public:
     void Close();
 
     /**
-     * Opens the the USB device, so we can send/read data.
+     * Opens the first PSP that is not in use yet, so we can send/read data.
      * @return true if successful.
      */
     bool Open();
@@ -53,22 +65,101 @@ public:
      */
     int USBBulkRead(int aEndpoint, int aSize, int aTimeOut);
 
+    /**
+     * Sends a Bulk In request on the USB bus, reading into the given buffer instead of the receive buffer.
+     * @param aEndpoint - The endpoint to use.
+     * @param aData - Where to put the data.
+     * @param aSize - Size of data to read.
+     * @param aTimeout - The timeout of the request to set.
+     * @return Amount of bytes read, < 0 on error .
+     */
+    int USBBulkRead(int aEndpoint, char* aData, int aSize, int aTimeOut);
+
     /**
      * Sends a Bulk Out request on the USB bus.
      * @param aEndpoint - The endpoint to use.
      * @param aData - Data to send in request
      * @param aSize - Size of data to send.
      * @param aTimeout - The timeout of the request to set.
-     * @return 0 on success, < 0 on error .
+     * @return Amount of bytes written, can be less than aSize on a timeout, the libusb error code if nothing was
+     * written.
      */
     int USBBulkWrite(int aEndpoint, char* aData, int aSize, int aTimeOut);
 
     /**
      * Handles traffic from USB.
+     * @param aData - A single chunk of at most cMaxUSBPacketSize as received from the PSP.
+     */
+    void ReceiveCallback(std::string_view aData);
+
+    /**
+     * Sets where frames from the PSP go.
+     * @param aDevice - Switch between the local PSPs and XLink Kai.
+     */
+    void SetIncomingConnection(std::shared_ptr<LocalSwitch> aDevice);
+
+    /**
+     * Turns pacing of the data sent to the PSP on or off, call before StartReceiverThread().
+     * @param aEnabled - true to pace.
+     */
+    void SetPacing(bool aEnabled);
+
+    /**
+     * Sets how frames for the PSP are scheduled, call before StartReceiverThread().
+     * @param aScheduler - Scheduler to use between the frame classes.
+     * @param aSmallFrameThreshold - Unicast frames up to this size get priority.
+     */
+    void SetSendScheduler(USBSendThread_Constants::Scheduler aScheduler, int aSmallFrameThreshold);
+
+    /**
+     * Turns filtering of unicast frames not meant for the PSP on or off.
+     * @param aEnabled - true to filter.
+     */
+    void SetMacFiltering(bool aEnabled);
+
+    /**
+     * Sets the thresholds of the broadcast storm and duplicate frame suppression, call before StartReceiverThread().
+     * @param aBroadcastRate - Broadcast and multicast frames per second allowed per source, 0 to not limit.
+     * @param aDuplicateWindowMS - Same frame within this time counts as a duplicate, 0 to not check.
+     */
+    void SetStormSuppression(int aBroadcastRate, int aDuplicateWindowMS);
+
+    /**
+     * Sets the user defined filters for both directions, call before StartReceiverThread().
+     * @param aToPSP - Filter for frames going to the PSP, can be nullptr.
+     * @param aFromPSP - Filter for frames coming from the PSP, can be nullptr.
+     */
+    void SetPacketFilters(std::shared_ptr<PacketFilter> aToPSP, std::shared_ptr<PacketFilter> aFromPSP);
+
+    /**
+     * Sets whether small frames may be packed together when the PSP says it can handle it, call before
+     * StartReceiverThread().
+     * @param aAllowed - true to allow it.
+     */
+    void SetAggregation(bool aAllowed);
+
+    /**
+     * Sets the directory the PSP can get to over HostFS, call before StartReceiverThread().
+     * @param aRoot - The directory, empty to not serve anything.
      */
-    void ReceiveCallback();
+    void SetHostFSRoot(const std::string& aRoot);
 
-    void SetIncomingConnection(std::shared_ptr<XLinkKaiConnection> aDevice);
+    /**
+     * Gets the demultiplexer for asynchronous data from the PSP, to set where debug prints go and to register
+     * handlers for other channels. Only use it before StartReceiverThread().
+     * @return The demultiplexer.
+     */
+    AsyncDemultiplexer& GetDemultiplexer();
+
+    /**
+     * Logs the flow tables of both directions, can be called from any thread while running.
+     */
+    void LogFlows() const;
+
+    /**
+     * @return Amount of frames from XLink Kai that were not sent to the PSP because they were for someone else.
+     */
+    [[nodiscard]] uint64_t GetFilteredFrameCount() const;
 
     void Send(std::string_view aData);
 
@@ -76,12 +167,53 @@ public:
 
 private:
     bool USBCheckDevice();
-    void HandleAsynchronous(USB_Constants::AsyncCommand& aData, int aLength);
+    void HandleAsynchronous(const AsyncCommandView& aData);
     void HandleAsynchronousSend();
     void HandleClose();
     void HandleError();
-    void HandleStitch(USB_Constants::AsyncCommand& aData, int aLength);
-    int  SendHello();
+
+    /**
+     * Answers the hello of the PSP, with our capabilities if the PSP sent its own.
+     * @param aHello - The hello from the PSP.
+     * @return Amount of bytes written, < 0 on error.
+     */
+    int SendHello(std::string_view aHello);
+
+    /**
+     * Passes a complete packet from the PSP on.
+     * @param aPacket - 802.3 frame from the PSP.
+     */
+    void ForwardFromPSP(std::string_view aPacket);
+
+    /**
+     * Unpacks a chunk holding several frames, each preceded by its length.
+     * @param aSubHeader - Subheader of the chunk.
+     */
+    void HandleAggregate(const AsyncSubHeaderView& aSubHeader);
+
+    /**
+     * Picks up the state of XLink Kai and flushes everything queued when it goes away, so no stale traffic from the
+     * previous session gets replayed. Called by the USB thread.
+     */
+    void CheckUpstream();
+
+    /**
+     * Logs what happened to the frames in both directions since the reader started.
+     */
+    void LogStatistics() const;
+
+    /**
+     * Writes a frame to the PSP, resuming from where the previous attempt stopped when a write times out halfway.
+     * @param aFrame - The frame to write.
+     * @return true if the whole frame got through.
+     */
+    bool WriteFrame(USB_Constants::USBFrame& aFrame);
+
+    /**
+     * Tells the PSP to throw away the frame it got halfway, so the next frame does not get glued onto it.
+     * @return true if the PSP got the marker.
+     */
+    bool SendAbortMarker();
 
     int mMaxBufferedMessages{0};
     int mMaxFatalRetries{0};
@@ -91,21 +223,55 @@ private:
 
     int mReadWriteRetryCounter{0};
 
-    /** True: program starts stitching packets. **/
-    bool                                               mReceiveStitching{false};
-    std::array<char, USB_Constants::cMaxUSBPacketSize> mTemporaryReceiveBuffer{0};
+    USBSendThread_Constants::Scheduler mSendScheduler{USBSendThread_Constants::Scheduler::DeficitRoundRobin};
+    int mSmallFrameThreshold{USBSendThread_Constants::cDefaultSmallFrameThreshold};
+
+    uint64_t mFramesSent{0};
+    uint64_t mFramesResumed{0};
+    uint64_t mFramesDropped{0};
+    // Whether we offer packing frames together, and whether the PSP took the offer, only touched by the USB thread.
+    bool     mAggregationAllowed{true};
+    bool     mAggregation{false};
+    // Whether the PSP understands the abort marker, without it a half written frame can only be undone by a reset.
+    bool     mAbortMarker{false};
+    uint64_t mFramesUnpacked{0};
+    // Frames the send thread packed together, kept for the statistics after it is gone.
+    uint64_t mAggregatedFrames{0};
+    // Chunks from the PSP thrown away before reassembly because nothing could take the frame.
+    uint64_t mChunksDroppedUpstreamDown{0};
+    // Whether frames from the PSP can go anywhere, and the XLink Kai session they belong to, only touched by the USB
+    // thread.
+    bool     mUpstreamAvailable{false};
+    uint64_t mUpstreamGeneration{0};
 
-    bool mStopRequest{false};
+    /** Routes debug prints and channels other than the user channel, only touched by the USB thread. **/
+    AsyncDemultiplexer mDemultiplexer{};
+    /** Serves files to the PSP, only touched by the USB thread. **/
+    HostFSServer mHostFSServer{};
+    /** Puts packets from the PSP back together, only touched by the USB thread. **/
+    USBReassembler mReassembler{};
+    /** Learns the addresses of the PSP, so frames for others can be kept off USB. **/
+    MacFilter         mMacFilter{};
+    std::atomic<bool> mMacFiltering{true};
+    /** Drops broadcast storms and duplicates, guarded by mSendMutex as frames come from XLink Kai and other PSPs. **/
+    StormFilter mStormFilter{};
+    std::mutex  mSendMutex{};
+    /** Filters set by the user, shared between all PSPs. **/
+    std::shared_ptr<PacketFilter> mFilterToPSP{nullptr};
+    std::shared_ptr<PacketFilter> mFilterFromPSP{nullptr};
+    /** Flows to the PSP, guarded by mSendMutex, flows from the PSP, only touched by the USB thread. **/
+    FlowTable mFlowsToPSP{};
+    FlowTable mFlowsFromPSP{};
+    /** Paces data to the PSP to what it can take, only touched by the USB thread. **/
+    USBPacer mPacer{};
+    /** Buffer bulk IN transfers land in, mapped from the device when possible. **/
+    USBTransferMemory mReceiveBuffer{};
 
-    /** True: program starts stitching packets. **/
-    bool mSendStitching{false};
+    std::atomic<bool> mStopRequest{false};
 
     libusb_device_handle*               mDeviceHandle{nullptr};
     bool                                mError{false};
-    std::shared_ptr<XLinkKaiConnection> mIncomingConnection{nullptr};
-    int                                 mLength{0};
-    int                                 mActualLength{0};
-    int                                 mStitchingLength{0};
+    std::shared_ptr<LocalSwitch>        mIncomingConnection{nullptr};
     std::shared_ptr<std::thread>        mUSBThread{nullptr};
     std::shared_ptr<USBReceiveThread>   mUSBReceiveThread{nullptr};
     std::shared_ptr<USBSendThread>      mUSBSendThread{nullptr};
@@ -0,0 +1,72 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - USBReassembler.h
+ *
+ * This file contains the header for a USBReassembler class which puts packets from the PSP back together.
+ *
+ **/
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "USBConstants.h"
+
+/**
+ * Puts packets the PSP split into chunks back together. Every chunk is checked against the size announced in the
+ * subheader of the first chunk, a chunk that does not fit throws the packet away and a new first chunk always starts a
+ * new packet, so a lost chunk costs just the packet it belonged to.
+ */
+class USBReassembler
+{
+public:
+    /**
+     * Adds a chunk on the user channel.
+     * @param aPayload - Everything after the asynchronous header of the chunk.
+     * @return The complete packet if this was its last chunk, empty otherwise. Valid until the next call.
+     */
+    std::string_view AddChunk(std::string_view aPayload);
+
+    /**
+     * Throws away the packet being put together.
+     */
+    void Reset();
+
+    /**
+     * Throws away the packet being put together because a chunk that is not part of it came in, counts as a resync.
+     * @param aReason - Why, for logging.
+     */
+    void Interrupt(const std::string& aReason);
+
+    /**
+     * @return true if a packet is halfway put together.
+     */
+    [[nodiscard]] bool IsInProgress() const;
+
+    /**
+     * @return Amount of times a packet got thrown away because a chunk did not fit.
+     */
+    [[nodiscard]] uint64_t GetResyncCount() const;
+
+    /**
+     * @return Amount of bytes thrown away.
+     */
+    [[nodiscard]] uint64_t GetDiscardedBytes() const;
+
+private:
+    /**
+     * Throws away the packet being put together and the given chunk.
+     * @param aReason - Why, for logging.
+     * @param aChunkSize - Size of the chunk that gets thrown away as well.
+     */
+    void Resync(const std::string& aReason, std::size_t aChunkSize);
+
+    std::array<char, USB_Constants::cMaxAsynchronousBuffer> mBuffer{};
+    std::size_t                                             mLength{0};
+    // Size announced in the subheader, 0 when not putting a packet together.
+    std::size_t mExpectedLength{0};
+
+    uint64_t mResyncCount{0};
+    uint64_t mDiscardedBytes{0};
+};
@@ -5,22 +5,41 @@
  *
  **/
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
+#include <queue>
+#include <string_view>
 #include <thread>
 
 #include "USBConstants.h"
 
-class XLinkKaiConnection;
+namespace USBReceiveThread_Constants
+{
+    // Frames taken from the queue at once, so the filter can work on a batch and the lock is taken less often
+    static constexpr std::size_t cMaxBatchSize{16};
+}  // namespace USBReceiveThread_Constants
+
+class LocalSwitch;
+class PacketFilter;
+class USBReader;
 
 class USBReceiveThread
 {
 public:
     /**
      * Constructor for USBReceiveThread.
-     * @param aConnection - The connection to send the data on.
+     * @param aConnection - The switch to send the data on.
+     * @param aSource - The PSP the data comes from.
+     * @param aMaxBufferSize - Maximum amount of frames in the queue.
+     * @param aFilter - Filter for frames coming from the PSP, can be nullptr.
      */
-    explicit USBReceiveThread(XLinkKaiConnection& aConnection, int aMaxBufferSize);
+    USBReceiveThread(LocalSwitch&                  aConnection,
+                     USBReader&                    aSource,
+                     int                           aMaxBufferSize,
+                     std::shared_ptr<PacketFilter> aFilter = nullptr);
     ~USBReceiveThread();
     USBReceiveThread(const USBReceiveThread& aUSBReceiveThread) = delete;
     USBReceiveThread& operator=(const USBReceiveThread& aUSBReceiveThread) = delete;
@@ -38,10 +57,10 @@ public:
 
     /**
      * Adds a message to the queue.
-     * @param aStruct - structure containing the message, length and if it should be stitched.
+     * @param aData - A complete packet from the PSP.
      * @return true if queue not full.
      */
-    bool AddToQueue(const USB_Constants::BinaryStitchUSBPacket& aStruct);
+    bool AddToQueue(std::string_view aData);
 
     /**
      * Clears all the queues in this class.
@@ -49,13 +68,16 @@ public:
     void ClearQueues();
 
 private:
-    int                                              mMaxBufferSize{0};
-    XLinkKaiConnection&                              mConnection;
-    bool                                             mDone{true};
-    bool                                             mError{false};
-    USB_Constants::BinaryStitchWiFiPacket            mLastReceivedMessage{};
-    std::mutex                                       mMutex{};
-    std::queue<USB_Constants::BinaryStitchUSBPacket> mQueue{};
-    bool                                             mStopRequest{false};
-    std::shared_ptr<std::thread>                     mThread{nullptr};
+    int                                         mMaxBufferSize{0};
+    LocalSwitch&                                mConnection;
+    USBReader&                                  mSource;
+    bool                                        mError{false};
+    std::mutex                                  mMutex{};
+    // Wakes the thread up when there is something in the queue or it should stop.
+    std::condition_variable                     mCondition{};
+    std::queue<USB_Constants::BinaryWiFiPacket> mQueue{};
+    std::shared_ptr<PacketFilter>               mFilter{nullptr};
+    std::array<USB_Constants::BinaryWiFiPacket, USBReceiveThread_Constants::cMaxBatchSize> mBatch{};
+    std::atomic<bool>                           mStopRequest{false};
+    std::shared_ptr<std::thread>                mThread{nullptr};
 };
@@ -5,30 +5,59 @@
  * for the PSP.
  **/
 
+#include <array>
 #include <memory>
 #include <mutex>
 #include <queue>
-#include <thread>
+#include <string_view>
+#include <vector>
 
 #include "USBConstants.h"
+#include "USBTransferMemory.h"
 
+struct libusb_device_handle;
 class XLinkKaiConnection;
 
-class USBSendThread
+namespace USBSendThread_Constants
 {
-public:
-    explicit USBSendThread(int aMaxBufferSize);
-
     /**
-     * Starts the thread to receive data from USB.
-     * @return true if successful.
+     * Classes frames for the PSP are put in, in order of priority.
      */
-    bool StartThread();
+    enum class FrameClass
+    {
+        SmallUnicast = 0,
+        BroadcastMulticast,
+        Large,
+        Count
+    };
 
-    /**
-     * Stops the thread.
-     */
-    void StopThread();
+    enum class Scheduler
+    {
+        DeficitRoundRobin = 0,
+        StrictPriority
+    };
+
+    static constexpr std::array<std::string_view, 2> cSchedulerTexts{"DeficitRoundRobin", "StrictPriority"};
+
+    // Bytes every class may send per round with deficit round robin, all at least one full frame.
+    static constexpr std::array<int, static_cast<int>(FrameClass::Count)> cQuanta{
+        USB_Constants::cMaxUSBFrameSize * 4, USB_Constants::cMaxUSBFrameSize * 2, USB_Constants::cMaxUSBFrameSize};
+
+    static constexpr int cDefaultSmallFrameThreshold{512};
+}  // namespace USBSendThread_Constants
+
+/**
+ * Formats packets from XLink Kai for the PSP. Packets get split into chunks straight into a buffer from a pool that
+ * is allocated up front, so the packet is copied only once on its way from XLink Kai to USB.
+ * Frames are queued per class, so a run of big broadcasts does not hold up small game traffic, and get taken out with
+ * either deficit round robin or strict priority between the classes.
+ * When the PSP can handle it, small frames that arrive while an earlier one is still waiting get packed into the same
+ * chunk, each preceded by its length, so they share a USB transaction.
+ */
+class USBSendThread
+{
+public:
+    explicit USBSendThread(int aMaxBufferSize);
 
     /**
      * Adds a message to the queue.
@@ -49,18 +78,118 @@ public:
     bool HasOutgoingData();
 
     /**
-     * Grabs a packet from the outgoing queue if the buffer is not empty.
+     * Gets the frame that should go out next, only call this when HasOutgoingData() is true.
+     * Keeps returning the same frame until PopFromOutgoingQueue() is called, the frame stays valid until then.
+     * @return The frame, ready to be written to USB.
      */
-    USB_Constants::BinaryStitchUSBPacket PopFromOutgoingQueue();
+    USB_Constants::USBFrame& FrontOfOutgoingQueue();
+
+    /**
+     * Removes the frame returned by FrontOfOutgoingQueue() and gives its buffer back to the pool.
+     */
+    void PopFromOutgoingQueue();
+
+    /**
+     * Sets how frames are taken out of the queues.
+     * @param aScheduler - Scheduler to use.
+     * @param aSmallFrameThreshold - Unicast frames up to this size go in the small frame class.
+     */
+    void SetScheduler(USBSendThread_Constants::Scheduler aScheduler, int aSmallFrameThreshold);
+
+    /**
+     * Turns packing of small frames into one chunk on or off, only turn it on when the PSP said it can handle it.
+     * @param aEnabled - true to pack frames.
+     */
+    void SetAggregation(bool aEnabled);
+
+    /**
+     * @return Amount of frames that got packed into a chunk together with an earlier frame.
+     */
+    [[nodiscard]] uint64_t GetAggregatedFrameCount();
+
+    /**
+     * Moves the pool to memory mapped from the given device, so frames can be written without the kernel copying
+     * them first. Clears the queues. Has to be called with nullptr before the device gets closed.
+     * @param aDeviceHandle - Device the frames will be written to, nullptr for normal memory.
+     */
+    void UseDeviceMemory(libusb_device_handle* aDeviceHandle);
+
+    /**
+     * Converts a scheduler name to a scheduler.
+     * @param aScheduler - Name of the scheduler.
+     * @return The scheduler, deficit round robin if the name is not known.
+     */
+    static USBSendThread_Constants::Scheduler ConvertSchedulerStringToScheduler(std::string_view aScheduler);
 
 private:
-    int                                              mMaxBufferSize{0};
-    bool                                             mDone{true};
-    bool                                             mError{false};
-    std::mutex                                       mMutex{};
-    USB_Constants::BinaryWiFiPacket                  mLastReceivedPacket{};
-    std::queue<USB_Constants::BinaryWiFiPacket>      mQueue{};
-    std::queue<USB_Constants::BinaryStitchUSBPacket> mOutgoingQueue{};
-    bool                                             mStopRequest{false};
-    std::shared_ptr<std::thread>                     mThread{nullptr};
+    /**
+     * Sets up the pool in the given memory, mutex must be held.
+     * @param aDeviceHandle - Device the frames will be written to, nullptr for normal memory.
+     */
+    void AllocateFrames(libusb_device_handle* aDeviceHandle);
+
+    /**
+     * Decides what class a frame belongs to.
+     * @param aData - The frame as received from XLink Kai.
+     * @return The class.
+     */
+    USBSendThread_Constants::FrameClass Classify(std::string_view aData) const;
+
+    /**
+     * Picks the class the next frame is taken from, mutex must be held and there must be data.
+     * @return Index of the class.
+     */
+    int SelectClass();
+
+    /**
+     * Splits data into chunks with their headers, directly into the given frame.
+     * @param aData - The data to split.
+     * @param aFrame - The frame to put the chunks in.
+     */
+    static void Fragment(std::string_view aData, USB_Constants::USBFrame& aFrame);
+
+    /**
+     * Starts a chunk that can hold several frames, with aData as its first frame.
+     * @param aData - The first frame.
+     * @param aFrame - The frame to put the chunk in.
+     */
+    static void StartAggregate(std::string_view aData, USB_Constants::USBFrame& aFrame);
+
+    /**
+     * Adds data to the chunk of the last frame in a class, if it is still waiting and there is room, mutex must be
+     * held.
+     * @param aData - The data to add.
+     * @param aClass - Class of the data.
+     * @return true if the data got added.
+     */
+    bool AddToAggregate(std::string_view aData, int aClass);
+
+    /**
+     * Tells whether the data can go in an aggregate at all.
+     * @param aData - The data.
+     * @return true if it fits.
+     */
+    static bool FitsInAggregate(std::string_view aData);
+
+    static constexpr int cClassCount{static_cast<int>(USBSendThread_Constants::FrameClass::Count)};
+
+    int                      mMaxBufferSize{0};
+    std::mutex               mMutex{};
+    USBTransferMemory        mFrameMemory{};
+    USB_Constants::USBFrame* mFrames{nullptr};
+    std::vector<int>         mFreeFrames{};
+
+    USBSendThread_Constants::Scheduler mScheduler{USBSendThread_Constants::Scheduler::DeficitRoundRobin};
+    int                                mSmallFrameThreshold{USBSendThread_Constants::cDefaultSmallFrameThreshold};
+    std::array<std::queue<int>, cClassCount> mOutgoingQueues{};
+    std::array<int, cClassCount>             mDeficits{};
+    std::size_t                              mQueuedFrames{0};
+    // Class FrontOfOutgoingQueue() picked, -1 if none picked yet.
+    int  mSelectedClass{-1};
+    int  mCurrentClass{0};
+    bool mQuantumAdded{false};
+    // Last frame per class that is an aggregate and can take more frames, -1 if none.
+    bool                         mAggregation{false};
+    std::array<int, cClassCount> mOpenAggregates{};
+    uint64_t                     mAggregatedFrames{0};
 };
@@ -0,0 +1,59 @@
+#pragma once
+
+/* Copyright (c) 2021 [Rick de Bondt] - USBTransferMemory.h
+ *
+ * This file contains the header for a USBTransferMemory class which holds memory to do USB transfers from/to.
+ *
+ **/
+
+#include <cstddef>
+#include <memory>
+
+struct libusb_device_handle;
+
+/**
+ * Memory for USB transfers. On Linux this is memory mapped from usbfs when possible, so the kernel does not have to
+ * copy the data in and out of its own buffers for every transfer. Falls back to normal memory otherwise.
+ */
+class USBTransferMemory
+{
+public:
+    USBTransferMemory() = default;
+    ~USBTransferMemory();
+    USBTransferMemory(const USBTransferMemory& aUSBTransferMemory) = delete;
+    USBTransferMemory& operator=(const USBTransferMemory& aUSBTransferMemory) = delete;
+
+    /**
+     * Allocates memory, frees anything allocated before.
+     * @param aDeviceHandle - Device the memory will be used with, nullptr to just get normal memory.
+     * @param aSize - Amount of bytes to allocate.
+     * @return true if successful.
+     */
+    bool Allocate(libusb_device_handle* aDeviceHandle, std::size_t aSize);
+
+    /**
+     * Frees the memory, has to be called before the device the memory was allocated for gets closed.
+     */
+    void Free();
+
+    /**
+     * @return Pointer to the memory, nullptr if nothing allocated.
+     */
+    [[nodiscard]] char* Data() const;
+
+    /**
+     * @return Amount of bytes allocated.
+     */
+    [[nodiscard]] std::size_t Size() const;
+
+    /**
+     * @return true if the memory is mapped from the device, false if it is normal memory.
+     */
+    [[nodiscard]] bool IsDeviceMemory() const;
+
+private:
+    char*                   mData{nullptr};
+    libusb_device_handle*   mDeviceHandle{nullptr};
+    std::unique_ptr<char[]> mFallback{nullptr};
+    std::size_t             mSize{0};
+};
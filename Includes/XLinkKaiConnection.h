@@ -6,8 +6,12 @@
  *
  * */
 
+#include <array>
+#include <atomic>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 
@@ -33,32 +37,53 @@ namespace XLinkKai_Constants
     static constexpr unsigned int         cPort{34523};
     static constexpr std::chrono::seconds cConnectionTimeout{10};
     static constexpr std::chrono::seconds cKeepAliveTimeout{60};
+    static constexpr std::chrono::seconds cReconnectDelay{1};
+    static constexpr std::chrono::seconds cMaxReconnectDelay{10};
+    // With fallbacks we ask a quiet engine if it is still there this many times per failover timeout, and only give
+    // up on it once this many of those probes went unanswered.
+    static constexpr int                  cProbesPerFailoverTimeout{3};
+    static constexpr unsigned int         cMaxUnansweredProbes{2};
+    // Amount of messages picked up from the socket with a single recvmmsg call.
+    static constexpr unsigned int         cMaxBatchedMessages{16};
+    // How long to wait for any XLink Kai engine to answer during discovery.
+    static constexpr std::chrono::milliseconds cDiscoveryTimeout{500};
+    // How long XLink Kai may stay silent before moving on to a fallback engine, if any are configured.
+    static constexpr std::chrono::milliseconds cFailoverTimeout{5000};
+
+    // Composed from the formats above, spelled out so they can be used at compile time.
+    static constexpr std::string_view cConnectString{"connect;CWUSB_Device;CWUSB;"};
+    static constexpr std::string_view cConnectedString{"connected;CWUSB_Device"};
+    static constexpr std::string_view cDisconnectedString{"disconnected;CWUSB_Device"};
+    static constexpr std::string_view cDisconnectString{"disconnect;"};
+    static constexpr std::string_view cKeepAliveString{"keepalive;"};
+    static constexpr std::string_view cEthernetDataString{"e;e;"};
+    static constexpr std::string_view cEthernetDataMetaString{"e;d;"};
+    static constexpr std::string_view cSettingDDSOnlyString{"setting;ddsonly;true"};
+    static constexpr std::string_view cSetESSIDString{"e;d;setessid;"};
 
-    static const std::string cConnectString{std::string(cConnectFormat) + cSeparator.data() +
-                                            cLocallyUniqueName.data() + cSeparator.data() + cEmulatorName.data() +
-                                            cSeparator.data()};
-
-    static const std::string cConnectedString{std::string(cConnectedFormat) + cSeparator.data() +
-                                              cLocallyUniqueName.data()};
-
-    static const std::string cDisconnectedString{std::string(cDisconnectedFormat) + cSeparator.data() +
-                                                 cLocallyUniqueName.data()};
-
-    static const std::string cDisconnectString{std::string(cDisconnectFormat) + cSeparator.data()};
-
-    static const std::string cKeepAliveString{std::string(cKeepAliveFormat) + cSeparator.data()};
-
-    static const std::string cEthernetDataString{std::string(cEthernetDataFormat) + cSeparator.data() +
-                                                 cEthernetDataFormat.data() + cSeparator.data()};
-
-    static const std::string cEthernetDataMetaString{std::string(cEthernetDataFormat) + cSeparator.data() +
-                                                     cEthernetDataMetaFormat.data() + cSeparator.data()};
-
-    static const std::string cSettingDDSOnlyString{std::string(cSettingFormat) + cSeparator.data() +
-                                                   cSettingDDSOnly.data() + cSeparator.data() + "true"};
+    /**
+     * Messages from XLink Kai we react to.
+     */
+    enum class KaiCommand
+    {
+        KeepAlive = 0,
+        Connected,
+        Disconnected,
+        EthernetData,
+        EthernetDataMeta,
+        Unknown
+    };
 
-    static const std::string cSetESSIDString(std::string(cEthernetDataMetaString.data()) + cSetESSIDFormat.data() +
-                                             cSeparator.data());
+    /**
+     * Maps the start of a message from XLink Kai to the command it represents. Ethernet data goes first because
+     * that is by far what we receive most.
+     */
+    static constexpr std::array<std::pair<std::string_view, KaiCommand>, 5> cCommands{
+        {{cEthernetDataString, KaiCommand::EthernetData},
+         {cKeepAliveString, KaiCommand::KeepAlive},
+         {cEthernetDataMetaString, KaiCommand::EthernetDataMeta},
+         {cConnectedString, KaiCommand::Connected},
+         {cDisconnectedString, KaiCommand::Disconnected}}};
 }  // namespace XLinkKai_Constants
 
 using namespace XLinkKai_Constants;
@@ -76,6 +101,21 @@ public:
 
     bool Open(std::string_view aArgument);
 
+    /**
+     * Looks for XLink Kai by sending a connect request to the broadcast address of every local interface and to the
+     * given hosts at the same time. The first engine that answers is remembered and used by the next Open().
+     * @param aKnownHosts - Hosts to try besides the broadcast addresses, e.g. where XLink Kai was found last time.
+     * @param aPort - Port XLink Kai listens on.
+     * @return True if XLink Kai was found, GetIp() will return its address.
+     */
+    bool Discover(const std::vector<std::string>& aKnownHosts, unsigned int aPort);
+
+    /**
+     * Gets the IP address of the XLink Kai engine we talk to.
+     * @return The IP address.
+     */
+    [[nodiscard]] std::string_view GetIp() const;
+
     /**
      * Creates a connection.
      * @param aIp - IP Address of the XLink Kai engine.
@@ -96,10 +136,25 @@ public:
      */
     bool ReadNextData();
 
+    /**
+     * Starts receiving data from XLink Kai and runs the connection state machine on its own thread.
+     * @return True if successful.
+     */
     bool StartReceiverThread();
 
+    /**
+     * Sends a command to XLink Kai, only connect and disconnect are allowed before XLink Kai confirmed the connection.
+     * @param aCommand - The command to send, e.g. cKeepAliveString.
+     * @param aData - Data to send after the command.
+     * @return True if successful.
+     */
     bool Send(std::string_view aCommand, std::string_view aData);
 
+    /**
+     * Sends an ethernet frame to XLink Kai.
+     * @param aData - The frame to send.
+     * @return True if successful.
+     */
     bool Send(std::string_view aData);
 
     void Close();
@@ -127,36 +182,188 @@ public:
      */
     void SetPort(unsigned int aPort);
 
-    void SetIncomingConnection(std::shared_ptr<USBReader> aDevice);
+    /**
+     * Adds a PSP to send ethernet frames from XLink Kai to, every PSP gets every frame and filters for itself.
+     * Must be called before StartReceiverThread().
+     * @param aDevice - The PSP to add.
+     */
+    void AddIncomingConnection(std::shared_ptr<USBReader> aDevice);
+
+    /**
+     * Gets how long XLink Kai took to confirm the last connect request, the closest thing to a round trip through
+     * XLink Kai we can measure.
+     * @return The round trip time, 0 if not connected yet.
+     */
+    [[nodiscard]] std::chrono::microseconds GetRoundTripTime() const;
+
+    /**
+     * @return true if XLink Kai confirmed the connection and takes ethernet frames, can be called from any thread.
+     */
+    [[nodiscard]] bool IsConnected() const;
+
+    /**
+     * Gets the session generation, which goes up every time XLink Kai confirms a connection. Lets others notice a
+     * reconnect even if they never saw the connection go down.
+     * @return The session generation, 0 if never connected.
+     */
+    [[nodiscard]] uint64_t GetSessionGeneration() const;
+
+    /**
+     * Sets XLink Kai engines to fall back to when the current one stops responding, must be called before
+     * StartReceiverThread().
+     * @param aFallbacks - Comma separated list of ip[:port] entries, e.g. "192.168.1.2,192.168.1.3:34523".
+     */
+    void SetFallbacks(std::string_view aFallbacks);
+
+    /**
+     * Sets how long XLink Kai may stay silent, or take to confirm a connection, before falling back to the next
+     * engine. Only used when fallbacks are set, otherwise cKeepAliveTimeout and cConnectionTimeout apply. A quiet
+     * engine gets sent keepalives of our own in the meantime, so it does not depend on how often the engine sends them.
+     * @param aTimeout - The timeout to use.
+     */
+    void SetFailoverTimeout(std::chrono::milliseconds aTimeout);
+
+    /**
+     * Gets the time between losing the last engine and being connected to the next one.
+     * @return Duration of the last failover, 0 if there has not been one.
+     */
+    [[nodiscard]] std::chrono::milliseconds GetLastFailoverTime() const;
 
 private:
+    /**
+     * Looks up which command a message from XLink Kai contains.
+     * @param aData - The message to look at.
+     * @return The command, KaiCommand::Unknown if not recognized.
+     */
+    static constexpr KaiCommand ParseCommand(std::string_view aData)
+    {
+        KaiCommand lReturn{KaiCommand::Unknown};
+        for (const auto& [lPrefix, lCommand] : cCommands) {
+            if (aData.starts_with(lPrefix)) {
+                lReturn = lCommand;
+                break;
+            }
+        }
+        return lReturn;
+    }
+
+    /**
+     * Sends command and data to XLink Kai as one datagram without concatenating them first.
+     * @param aCommand - The command to send.
+     * @param aData - Data to send after the command.
+     * @return True if successful.
+     */
+    bool SendTo(std::string_view aCommand, std::string_view aData);
+
+    /**
+     * Arms an asynchronous receive on the socket.
+     */
+    void StartReceiving();
+
     /**
      * Handles traffic from XLink Kai.
      */
     void ReceiveCallback(const boost::system::error_code& aError, size_t aBytesReceived);
 
+#if defined(USE_RECVMMSG)
+    /**
+     * Fires when the socket has data, reads all queued messages in batches using recvmmsg.
+     */
+    void ReadableCallback(const boost::system::error_code& aError);
+#endif
+
+    /**
+     * Handles a single message from XLink Kai.
+     * @param aData - The message as received.
+     */
+    void HandleMessage(std::string_view aData);
+
+    /**
+     * Fires when XLink Kai did not confirm the connection in time.
+     */
+    void ConnectTimeoutCallback(const boost::system::error_code& aError);
+
+    /**
+     * Fires periodically to check whether XLink Kai is still sending us anything.
+     */
+    void KeepAliveCallback(const boost::system::error_code& aError);
+
+    /**
+     * Gets how long XLink Kai may stay silent before it is considered gone.
+     * @return The keepalive timeout.
+     */
+    [[nodiscard]] std::chrono::milliseconds GetKeepAliveTimeout() const;
+
+    /**
+     * Resets the session state after losing XLink Kai and moves on to the next engine, or schedules a reconnect.
+     * @param aReason - Why the connection got lost, gets logged.
+     */
+    void HandleConnectionLost(const std::string& aReason);
+
+    /**
+     * Tears down the current session and starts a new one.
+     */
+    void Reconnect();
+
+    /**
+     * Schedules a reconnect, the delay doubles with every failed attempt up to cMaxReconnectDelay.
+     */
+    void ScheduleReconnect();
+
+    /**
+     * Arms the keepalive watchdog so it fires when the last received message is cKeepAliveTimeout old, or, with
+     * fallbacks, when the next probe is due.
+     */
+    void StartKeepAliveTimer();
+
+    /**
+     * @return Time between probes of a quiet engine, only used when fallbacks are set.
+     */
+    [[nodiscard]] std::chrono::milliseconds GetProbeInterval() const;
+
     /**
      * Sends a keepalive back to the XLink Kai engine, call this function when a keepalive is received.
      * @return True if all bytes have been sent over successfully.
      */
     bool HandleKeepAlive();
 
-    bool                                               mConnected{false};
-    bool                                               mConnectInitiated{false};
-    bool                                               mSettingsSent{false};
-    std::chrono::time_point<std::chrono::system_clock> mConnectionTimerStart{std::chrono::seconds{0}};
-    std::chrono::time_point<std::chrono::system_clock> mKeepAliveTimerStart{std::chrono::seconds{0}};
-
-    std::array<char, cMaxLength> mData{};
-    // Raw ethernet data received from XLink Kai
-    std::string                    mEthernetData{};
-    std::shared_ptr<USBReader>     mIncomingConnection{nullptr};
+    std::atomic<bool>                     mConnected{false};
+    std::atomic<bool>                     mConnectInitiated{false};
+    std::atomic<uint64_t>                 mSessionGeneration{0};
+    std::chrono::steady_clock::time_point mLastReceived{};
+    // Keepalives we sent since the last message from the engine, and whether the next keepalive is its answer.
+    unsigned int mUnansweredProbes{0};
+    bool         mProbeOutstanding{false};
+    std::chrono::seconds                  mReconnectDelay{cReconnectDelay};
+
+    // Primary engine first, then the fallbacks, only filled when there are fallbacks.
+    std::vector<std::pair<std::string, unsigned int>> mEndpoints{};
+    std::size_t                                       mEndpointIndex{0};
+    std::vector<std::pair<std::string, unsigned int>> mFallbacks{};
+    std::chrono::milliseconds                         mFailoverTimeout{cFailoverTimeout};
+    bool                                              mFailingOver{false};
+    std::size_t                                       mFailoverAttempts{0};
+    std::chrono::steady_clock::time_point             mFailoverStart{};
+    std::chrono::milliseconds                         mLastFailoverTime{0};
+
+    std::array<char, cMaxLength>   mData{};
+#if defined(USE_RECVMMSG)
+    std::array<std::array<char, cMaxLength>, cMaxBatchedMessages> mBatchData{};
+#endif
+    std::vector<std::shared_ptr<USBReader>> mIncomingConnections{};
+    std::chrono::steady_clock::time_point   mConnectSent{};
+    std::atomic<std::chrono::microseconds::rep> mRoundTripTime{0};
     std::string                    mIp{cIp};
-    boost::asio::io_service        mIoService{};
+    boost::asio::io_context        mIoContext{};
     unsigned int                   mPort{cPort};
     bool                           mHosting{};
     bool                           mUseHostSSID{};
     std::shared_ptr<std::thread>   mReceiverThread{nullptr};
     boost::asio::ip::udp::endpoint mRemote{};
-    boost::asio::ip::udp::socket   mSocket{mIoService};
+    // Where the last received message came from, kept apart from mRemote because the send side reads that.
+    boost::asio::ip::udp::endpoint mSender{};
+    boost::asio::ip::udp::socket   mSocket{mIoContext};
+    boost::asio::steady_timer      mConnectTimer{mIoContext};
+    boost::asio::steady_timer      mKeepAliveTimer{mIoContext};
+    boost::asio::steady_timer      mReconnectTimer{mIoContext};
 };
@@ -0,0 +1,49 @@
+#include "../Includes/AsyncDemultiplexer.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - AsyncDemultiplexer.cpp */
+
+#include <string>
+
+#include "../Includes/DebugPrintLane.h"
+#include "../Includes/Logger.h"
+#include "../Includes/USBPacketViews.h"
+
+void AsyncDemultiplexer::RegisterHandler(uint32_t aChannel, Handler aHandler)
+{
+    mHandlers[aChannel] = std::move(aHandler);
+}
+
+void AsyncDemultiplexer::SetDebugPrintLane(std::shared_ptr<DebugPrintLane> aLane)
+{
+    mDebugPrintLane = std::move(aLane);
+}
+
+void AsyncDemultiplexer::PostDebugPrint(std::string_view aPrint)
+{
+    if (mDebugPrintLane != nullptr) {
+        mDebugPrintLane->Post(aPrint);
+    } else {
+        Logger::GetInstance().Log(std::string(DebugPrintLane_Constants::cPrefix) + std::string(aPrint),
+                                  Logger::Level::INFO);
+    }
+}
+
+void AsyncDemultiplexer::Dispatch(const AsyncCommandView& aData)
+{
+    auto lHandler{mHandlers.find(aData.Channel())};
+    if (lHandler != mHandlers.end()) {
+        lHandler->second(aData.Payload());
+    } else {
+        // Only say so once, some plugins keep talking on their channel
+        if (mUnhandled == 0) {
+            Logger::GetInstance().Log("No handler for asynchronous channel " + std::to_string(aData.Channel()),
+                                      Logger::Level::DEBUG);
+        }
+        mUnhandled++;
+    }
+}
+
+uint64_t AsyncDemultiplexer::GetUnhandledCount() const
+{
+    return mUnhandled;
+}
@@ -0,0 +1,110 @@
+#include "../Includes/DebugPrintLane.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - DebugPrintLane.cpp */
+
+#include "../Includes/Logger.h"
+
+using namespace DebugPrintLane_Constants;
+
+bool DebugPrintLane::Start(const std::string& aPath)
+{
+    bool lReturn{true};
+
+    if (mThread == nullptr) {
+        if (!aPath.empty()) {
+            mFile.open(aPath, std::ios::app);
+            if (!mFile.is_open()) {
+                Logger::GetInstance().Log("Could not open PSP debug log: " + aPath + ", logging instead",
+                                          Logger::Level::WARNING);
+            }
+        }
+
+        mStopRequest = false;
+        mThread      = std::make_shared<std::thread>([&] {
+            std::queue<std::string> lPrints{};
+            std::unique_lock<std::mutex> lLock{mMutex};
+            while (!mStopRequest || !mPrints.empty()) {
+                mCondition.wait(lLock, [&] { return mStopRequest || !mPrints.empty(); });
+                // Take everything at once, so the USB thread never waits for a write
+                lPrints.swap(mPrints);
+                lLock.unlock();
+
+                while (!lPrints.empty()) {
+                    Write(lPrints.front());
+                    lPrints.pop();
+                }
+
+                lLock.lock();
+            }
+        });
+    } else {
+        lReturn = false;
+    }
+
+    return lReturn;
+}
+
+void DebugPrintLane::Stop()
+{
+    if (mThread != nullptr) {
+        {
+            std::lock_guard<std::mutex> lLock{mMutex};
+            mStopRequest = true;
+        }
+        mCondition.notify_one();
+
+        if (mThread->joinable()) {
+            mThread->join();
+        }
+        mThread = nullptr;
+
+        if (mFile.is_open()) {
+            mFile.close();
+        }
+
+        if (mDropped > 0) {
+            Logger::GetInstance().Log("PSP debug prints dropped: " + std::to_string(mDropped), Logger::Level::INFO);
+        }
+    }
+}
+
+void DebugPrintLane::Post(std::string_view aPrint)
+{
+    bool lQueued{false};
+    {
+        std::lock_guard<std::mutex> lLock{mMutex};
+        if (mThread != nullptr && mPrints.size() < cMaxQueuedPrints) {
+            mPrints.emplace(aPrint);
+            lQueued = true;
+        }
+    }
+
+    if (lQueued) {
+        mCondition.notify_one();
+    } else {
+        mDropped++;
+    }
+}
+
+void DebugPrintLane::Write(std::string_view aPrint)
+{
+    // The PSP pads its prints, leave that out
+    std::size_t lEnd{aPrint.find_last_not_of(std::string_view("\0\r\n", 3))};
+    std::string_view lPrint{aPrint.substr(0, lEnd == std::string_view::npos ? 0 : lEnd + 1)};
+
+    if (mFile.is_open()) {
+        mFile << lPrint << std::endl;
+    } else {
+        Logger::GetInstance().Log(std::string(cPrefix) + std::string(lPrint), Logger::Level::INFO);
+    }
+}
+
+uint64_t DebugPrintLane::GetDroppedCount() const
+{
+    return mDropped;
+}
+
+DebugPrintLane::~DebugPrintLane()
+{
+    Stop();
+}
@@ -0,0 +1,294 @@
+#include "../Includes/Engine.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - Engine.cpp */
+
+#include <algorithm>
+#include <filesystem>
+
+#include "../Includes/DebugPrintLane.h"
+#include "../Includes/LocalSwitch.h"
+#include "../Includes/Logger.h"
+#include "../Includes/PacketFilter.h"
+#include "../Includes/USBReader.h"
+#include "../Includes/XLinkKaiConnection.h"
+
+using namespace Engine_Constants;
+using namespace SettingsModel_Constants;
+
+Engine::Engine(SettingsModel& aSettingsModel, std::string_view aProgramPath, std::string_view aConfigPath) :
+    mSettingsModel(aSettingsModel), mProgramPath(aProgramPath), mConfigPath(aConfigPath)
+{}
+
+Engine::~Engine()
+{
+    Stop();
+}
+
+void Engine::Run()
+{
+    std::unique_lock<std::mutex> lLock{mMutex};
+    while (!mQuit) {
+        if (!mCommands.empty()) {
+            Command lCommand{mCommands.front()};
+            mCommands.pop();
+            lLock.unlock();
+            HandleCommand(lCommand);
+            lLock.lock();
+        } else if (mLogFlows) {
+            mLogFlows = false;
+            lLock.unlock();
+            for (auto& lReader : mUSBReaderConnections) {
+                lReader->LogFlows();
+            }
+            lLock.lock();
+        } else if (mStartPending && std::chrono::steady_clock::now() >= mNextAttempt) {
+            lLock.unlock();
+            if (Start()) {
+                mStartPending = false;
+            } else {
+                Logger::GetInstance().Log("Retrying in " + std::to_string(cRetryDelay.count()) + " seconds",
+                                          Logger::Level::INFO);
+                mNextAttempt = std::chrono::steady_clock::now() + cRetryDelay;
+            }
+            lLock.lock();
+        } else if (mStartPending) {
+            mCondition.wait_until(lLock, mNextAttempt);
+        } else {
+            mCondition.wait(lLock);
+        }
+    }
+    lLock.unlock();
+
+    Stop();
+}
+
+void Engine::PostCommand(Command aCommand)
+{
+    if (aCommand != Command::NoCommand) {
+        {
+            std::lock_guard<std::mutex> lLock{mMutex};
+            mCommands.push(aCommand);
+        }
+        mCondition.notify_one();
+    }
+}
+
+void Engine::Quit()
+{
+    {
+        std::lock_guard<std::mutex> lLock{mMutex};
+        mQuit = true;
+    }
+    mCondition.notify_one();
+}
+
+void Engine::RequestFlowLog()
+{
+    {
+        std::lock_guard<std::mutex> lLock{mMutex};
+        mLogFlows = true;
+    }
+    mCondition.notify_one();
+}
+
+void Engine::HandleCommand(Command aCommand)
+{
+    mSettingsModel.mCommand = aCommand;
+    switch (aCommand) {
+        case Command::StartEngine:
+            if (mSettingsModel.mEngineStatus != EngineStatus::Running) {
+                mStartPending = true;
+                mNextAttempt  = std::chrono::steady_clock::now();
+            }
+            break;
+        case Command::StopEngine:
+            mStartPending = false;
+            Stop();
+            break;
+        case Command::RestartEngine:
+            Restart();
+            break;
+        case Command::SaveSettings:
+            if (!mSettingsModel.SaveToFile(mConfigPath)) {
+                Logger::GetInstance().Log("Could not save settings to: " + mConfigPath, Logger::Level::ERROR);
+            }
+            break;
+        case Command::NoCommand:
+            break;
+    }
+    mSettingsModel.mCommand = Command::NoCommand;
+}
+
+bool Engine::Start()
+{
+    bool lReturn{false};
+
+    if (mXLinkKaiConnection == nullptr) {
+        CreateComponents();
+    }
+
+    // Try to open Xlink Connection
+    if (!mXLinkKaiOpen) {
+        mXLinkKaiOpen = mXLinkKaiConnection->Open(mSettingsModel.mXLinkIp, std::stoi(mSettingsModel.mXLinkPort));
+        if (!mXLinkKaiOpen) {
+            Logger::GetInstance().Log("Could not open XLink Kai connection", Logger::Level::INFO);
+            mXLinkKaiConnection->Close();
+        }
+    }
+
+    // Try to open USB Connection, the first PSP is required
+    if (!mUSBOpen) {
+        mUSBOpen = mUSBReaderConnections.front()->Open();
+        if (!mUSBOpen) {
+            Logger::GetInstance().Log("Could not open USB connection", Logger::Level::INFO);
+            mUSBReaderConnections.front()->Close();
+        }
+    }
+
+    if (mXLinkKaiOpen && mUSBOpen) {
+        if (StartComponents()) {
+            lReturn                      = true;
+            mSettingsModel.mEngineStatus = EngineStatus::Running;
+        } else {
+            Logger::GetInstance().Log("Failed to start receiver threads", Logger::Level::ERROR);
+            Stop();
+            mSettingsModel.mEngineStatus = EngineStatus::Error;
+        }
+    }
+
+    return lReturn;
+}
+
+void Engine::Stop()
+{
+    if (mXLinkKaiConnection != nullptr) {
+        // XLink Kai goes first, so its thread is not handing frames to readers that are being torn down
+        mXLinkKaiConnection->Close();
+        for (auto& lReader : mUSBReaderConnections) {
+            lReader->Close();
+        }
+        mDebugPrintLane->Stop();
+        mLocalSwitch->LogStatistics();
+        mFilterToPSP->LogStatistics("Filter to PSP");
+        mFilterFromPSP->LogStatistics("Filter from PSP");
+
+        mUSBReaderConnections.clear();
+        mLocalSwitch        = nullptr;
+        mXLinkKaiConnection = nullptr;
+        mFilterToPSP        = nullptr;
+        mFilterFromPSP      = nullptr;
+        mDebugPrintLane     = nullptr;
+        mXLinkKaiOpen       = false;
+        mUSBOpen            = false;
+
+        if (mSettingsModel.mEngineStatus == EngineStatus::Running) {
+            mSettingsModel.mEngineStatus = EngineStatus::Idle;
+        }
+    }
+}
+
+void Engine::Restart()
+{
+    std::chrono::steady_clock::time_point lStart{std::chrono::steady_clock::now()};
+
+    Stop();
+    if (!mSettingsModel.LoadFromFile(mConfigPath)) {
+        Logger::GetInstance().Log("Could not reload settings, restarting with the old ones", Logger::Level::WARNING);
+    }
+    Logger::GetInstance().SetLogLevel(mSettingsModel.mLogLevel);
+
+    if (Start()) {
+        mStartPending = false;
+        Logger::GetInstance().Log(
+            "Restarted in " +
+                std::to_string(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lStart)
+                        .count()) +
+                "ms",
+            Logger::Level::INFO);
+    } else {
+        Logger::GetInstance().Log("Restart failed, retrying in " + std::to_string(cRetryDelay.count()) + " seconds",
+                                  Logger::Level::WARNING);
+        mStartPending = true;
+        mNextAttempt  = std::chrono::steady_clock::now() + cRetryDelay;
+    }
+}
+
+void Engine::CreateComponents()
+{
+    mXLinkKaiConnection = std::make_shared<XLinkKaiConnection>();
+    mLocalSwitch        = std::make_shared<LocalSwitch>(mXLinkKaiConnection);
+
+    // One reader per PSP, the first one is required, the rest are optional
+    for (int lCount = 0; lCount < std::max(1, mSettingsModel.mMaxPSPs); lCount++) {
+        mUSBReaderConnections.push_back(std::make_shared<USBReader>(mSettingsModel.mMaxBufferedMessages,
+                                                                    mSettingsModel.mMaxFatalRetries,
+                                                                    mSettingsModel.mMaxReadWriteRetries,
+                                                                    mSettingsModel.mReadTimeOutMS,
+                                                                    mSettingsModel.mWriteTimeOutMS));
+    }
+
+    // Same rules for every PSP, tagged frames from both directions end up in the same capture
+    mFilterToPSP   = std::make_shared<PacketFilter>();
+    mFilterFromPSP = std::make_shared<PacketFilter>();
+    mFilterToPSP->Compile(mSettingsModel.mFilterToPSP);
+    mFilterFromPSP->Compile(mSettingsModel.mFilterFromPSP);
+    if (!mSettingsModel.mFilterCaptureFile.empty()) {
+        mFilterToPSP->SetCaptureFile(mProgramPath + "to_psp_" + mSettingsModel.mFilterCaptureFile);
+        mFilterFromPSP->SetCaptureFile(mProgramPath + "from_psp_" + mSettingsModel.mFilterCaptureFile);
+    }
+
+    mDebugPrintLane = std::make_shared<DebugPrintLane>();
+
+    if (mSettingsModel.mAutoDiscoverXLinkKai) {
+        if (mXLinkKaiConnection->Discover({mSettingsModel.mXLinkIp}, std::stoi(mSettingsModel.mXLinkPort))) {
+            // Remember where XLink Kai was found, so it gets asked directly next time.
+            mSettingsModel.mXLinkIp = mXLinkKaiConnection->GetIp();
+            mSettingsModel.SaveToFile(mConfigPath);
+        } else {
+            Logger::GetInstance().Log("Using configured XLink Kai address: " + mSettingsModel.mXLinkIp,
+                                      Logger::Level::INFO);
+        }
+    }
+}
+
+bool Engine::StartComponents()
+{
+    // Pick up any other PSPs that are attached, no need to wait for them
+    std::shared_ptr<USBReader> lUSBReaderConnection{mUSBReaderConnections.front()};
+    std::erase_if(mUSBReaderConnections, [&](const std::shared_ptr<USBReader>& aReader) {
+        return aReader != lUSBReaderConnection && !aReader->Open();
+    });
+    Logger::GetInstance().Log("Bridging " + std::to_string(mUSBReaderConnections.size()) + " PSP(s)",
+                              Logger::Level::INFO);
+
+    // Debug prints of all PSPs get written on their own thread
+    mDebugPrintLane->Start(mSettingsModel.mPSPDebugLog.empty() ? "" : mProgramPath + mSettingsModel.mPSPDebugLog);
+
+    for (auto& lReader : mUSBReaderConnections) {
+        lReader->SetIncomingConnection(mLocalSwitch);
+        lReader->GetDemultiplexer().SetDebugPrintLane(mDebugPrintLane);
+        lReader->SetHostFSRoot(mSettingsModel.mHostFSRoot.empty()
+                                   ? ""
+                                   : (std::filesystem::path(mProgramPath) / mSettingsModel.mHostFSRoot).string());
+        lReader->SetPacing(mSettingsModel.mUSBPacing);
+        lReader->SetSendScheduler(USBSendThread::ConvertSchedulerStringToScheduler(mSettingsModel.mUSBSendScheduler),
+                                  mSettingsModel.mUSBSmallFrameThreshold);
+        lReader->SetMacFiltering(mSettingsModel.mUSBMacFilter);
+        lReader->SetAggregation(mSettingsModel.mUSBAggregation);
+        lReader->SetStormSuppression(mSettingsModel.mBroadcastRateLimit, mSettingsModel.mDuplicateWindowMS);
+        lReader->SetPacketFilters(mFilterToPSP->IsEmpty() ? nullptr : mFilterToPSP,
+                                  mFilterFromPSP->IsEmpty() ? nullptr : mFilterFromPSP);
+        mLocalSwitch->AddDevice(lReader);
+        mXLinkKaiConnection->AddIncomingConnection(lReader);
+    }
+    mXLinkKaiConnection->SetFallbacks(mSettingsModel.mXLinkFallbacks);
+    mXLinkKaiConnection->SetFailoverTimeout(std::chrono::milliseconds(mSettingsModel.mXLinkFailoverTimeoutMS));
+
+    bool lReturn{mXLinkKaiConnection->StartReceiverThread()};
+    for (auto& lReader : mUSBReaderConnections) {
+        lReturn = lReader->StartReceiverThread() && lReturn;
+    }
+
+    return lReturn;
+}
@@ -0,0 +1,129 @@
+#include "../Includes/FlowTable.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - FlowTable.cpp */
+
+#include <cstdlib>
+#include <sstream>
+
+#include "../Includes/NetConversionFunctions.h"
+#include "../Includes/NetworkingHeaders.h"
+
+using namespace FlowTable_Constants;
+
+void FlowTable::Update(std::string_view aFrame)
+{
+    if (aFrame.size() >= Net_8023_Constants::cHeaderLength) {
+        uint64_t lSource{GetMacAddress(aFrame, Net_8023_Constants::cSourceAddressIndex)};
+        uint64_t lDestination{GetMacAddress(aFrame, Net_8023_Constants::cDestinationAddressIndex)};
+        uint16_t lEtherType{bswap_16(GetRawData<uint16_t>(aFrame, Net_8023_Constants::cEtherTypeIndex))};
+
+        std::size_t lHash{(lSource * 31 + lDestination) * 31 + lEtherType};
+        Entry*      lEntry{nullptr};
+        for (std::size_t lProbe = 0; lProbe < cMaxProbes && lEntry == nullptr; lProbe++) {
+            Entry& lCandidate{mEntries.at((lHash + lProbe) % cMaxFlows)};
+            if (!lCandidate.used.load(std::memory_order_relaxed) ||
+                (lCandidate.source.load(std::memory_order_relaxed) == lSource &&
+                 lCandidate.destination.load(std::memory_order_relaxed) == lDestination &&
+                 lCandidate.etherType.load(std::memory_order_relaxed) == lEtherType)) {
+                lEntry = &lCandidate;
+            }
+        }
+
+        if (lEntry != nullptr) {
+            int64_t lNow{std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now().time_since_epoch())
+                             .count()};
+
+            uint32_t lSequence{lEntry->sequence.load(std::memory_order_relaxed)};
+            lEntry->sequence.store(lSequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            if (!lEntry->used.load(std::memory_order_relaxed)) {
+                lEntry->source.store(lSource, std::memory_order_relaxed);
+                lEntry->destination.store(lDestination, std::memory_order_relaxed);
+                lEntry->etherType.store(lEtherType, std::memory_order_relaxed);
+                lEntry->used.store(true, std::memory_order_relaxed);
+            } else {
+                // Jitter as in RFC 3550, smoothed difference between consecutive inter-arrival times
+                int64_t lInterArrival{lNow - lEntry->lastSeen.load(std::memory_order_relaxed)};
+                if (lEntry->packets.load(std::memory_order_relaxed) > 1) {
+                    int64_t lJitter{lEntry->jitter.load(std::memory_order_relaxed)};
+                    lJitter += (std::llabs(lInterArrival - lEntry->interArrival) - lJitter) / 16;
+                    lEntry->jitter.store(lJitter, std::memory_order_relaxed);
+                }
+                lEntry->interArrival = lInterArrival;
+            }
+
+            lEntry->packets.fetch_add(1, std::memory_order_relaxed);
+            lEntry->bytes.fetch_add(aFrame.size(), std::memory_order_relaxed);
+            lEntry->lastSeen.store(lNow, std::memory_order_relaxed);
+
+            lEntry->sequence.store(lSequence + 2, std::memory_order_release);
+        } else {
+            mOverflowCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+std::vector<FlowRecord> FlowTable::Snapshot() const
+{
+    std::vector<FlowRecord> lReturn{};
+
+    for (const Entry& lEntry : mEntries) {
+        FlowRecord lRecord{};
+        bool       lUsed{false};
+        uint32_t   lBefore{0};
+        uint32_t   lAfter{0};
+
+        do {
+            lBefore = lEntry.sequence.load(std::memory_order_acquire);
+            lUsed   = lEntry.used.load(std::memory_order_relaxed);
+
+            lRecord.source      = lEntry.source.load(std::memory_order_relaxed);
+            lRecord.destination = lEntry.destination.load(std::memory_order_relaxed);
+            lRecord.etherType   = lEntry.etherType.load(std::memory_order_relaxed);
+            lRecord.packets     = lEntry.packets.load(std::memory_order_relaxed);
+            lRecord.bytes       = lEntry.bytes.load(std::memory_order_relaxed);
+            lRecord.lastSeen    = std::chrono::nanoseconds(lEntry.lastSeen.load(std::memory_order_relaxed));
+            lRecord.jitter      = std::chrono::nanoseconds(lEntry.jitter.load(std::memory_order_relaxed));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            lAfter = lEntry.sequence.load(std::memory_order_relaxed);
+            // Odd means the writer was busy with it, try again
+        } while ((lBefore & 1U) != 0 || lBefore != lAfter);
+
+        if (lUsed) {
+            lReturn.push_back(lRecord);
+        }
+    }
+
+    return lReturn;
+}
+
+uint64_t FlowTable::GetOverflowCount() const
+{
+    return mOverflowCount.load(std::memory_order_relaxed);
+}
+
+std::string FlowTable::ToString(std::string_view aName) const
+{
+    std::chrono::nanoseconds lNow{std::chrono::steady_clock::now().time_since_epoch()};
+    std::stringstream        lFormattedString;
+
+    lFormattedString << aName << ":";
+    for (const FlowRecord& lRecord : Snapshot()) {
+        lFormattedString << std::endl
+                         << MacToString(lRecord.source) << " -> " << MacToString(lRecord.destination) << " 0x"
+                         << std::hex << std::setfill('0') << std::setw(4) << lRecord.etherType << std::dec
+                         << ": " << lRecord.packets << " packets, " << lRecord.bytes << " bytes, last seen "
+                         << std::chrono::duration_cast<std::chrono::milliseconds>(lNow - lRecord.lastSeen).count()
+                         << " ms ago, jitter "
+                         << std::chrono::duration_cast<std::chrono::microseconds>(lRecord.jitter).count() << " us";
+    }
+
+    if (GetOverflowCount() > 0) {
+        lFormattedString << std::endl << GetOverflowCount() << " frames not accounted, table full";
+    }
+
+    return lFormattedString.str();
+}
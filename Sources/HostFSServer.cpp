@@ -0,0 +1,456 @@
+#include "../Includes/HostFSServer.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - HostFSServer.cpp */
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <ctime>
+
+#include "../Includes/Logger.h"
+#include "../Includes/USBPacketViews.h"
+
+using namespace HostFSServer_Constants;
+using namespace USB_Constants;
+
+/**
+ * Gets a command struct from the data, if the data is big enough.
+ * @param aData - The data.
+ * @param aCommand - Where to put the command.
+ * @return true if successful.
+ */
+template<typename Type> static bool ParseCommand(std::string_view aData, Type& aCommand)
+{
+    bool lReturn{aData.size() >= sizeof(Type)};
+    if (lReturn) {
+        std::memcpy(&aCommand, aData.data(), sizeof(Type));
+    }
+    return lReturn;
+}
+
+/**
+ * Converts the time a file was last written to the way the PSP wants it.
+ * @param aTime - Time the file was last written.
+ * @return The time for the PSP.
+ */
+static PspDateTime ToPspDateTime(std::filesystem::file_time_type aTime)
+{
+    PspDateTime lReturn{};
+    std::time_t lTime{std::chrono::system_clock::to_time_t(std::chrono::file_clock::to_sys(
+        std::chrono::time_point_cast<std::chrono::file_clock::duration>(aTime)))};
+    std::tm*    lCalendarTime{std::localtime(&lTime)};
+
+    if (lCalendarTime != nullptr) {
+        lReturn.year   = static_cast<uint16_t>(lCalendarTime->tm_year + 1900);
+        lReturn.month  = static_cast<uint16_t>(lCalendarTime->tm_mon + 1);
+        lReturn.day    = static_cast<uint16_t>(lCalendarTime->tm_mday);
+        lReturn.hour   = static_cast<uint16_t>(lCalendarTime->tm_hour);
+        lReturn.minute = static_cast<uint16_t>(lCalendarTime->tm_min);
+        lReturn.second = static_cast<uint16_t>(lCalendarTime->tm_sec);
+    }
+
+    return lReturn;
+}
+
+void HostFSServer::SetTransport(ReadFunction aRead, WriteFunction aWrite, YieldFunction aYield)
+{
+    mRead  = std::move(aRead);
+    mWrite = std::move(aWrite);
+    mYield = std::move(aYield);
+}
+
+bool HostFSServer::SetRoot(const std::filesystem::path& aRoot)
+{
+    std::error_code lError{};
+    bool            lReturn{std::filesystem::is_directory(aRoot, lError)};
+
+    if (lReturn) {
+        mRoot = std::filesystem::weakly_canonical(aRoot, lError);
+        Logger::GetInstance().Log("Serving " + mRoot.string() + " to the PSP over HostFS", Logger::Level::INFO);
+    } else {
+        mRoot.clear();
+        Logger::GetInstance().Log("HostFS root is not a directory: " + aRoot.string(), Logger::Level::ERROR);
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::IsEnabled() const
+{
+    return !mRoot.empty() && mRead != nullptr && mWrite != nullptr;
+}
+
+bool HostFSServer::HandleCommand(std::string_view aData)
+{
+    bool              lReturn{true};
+    HostFsCommandView lCommand{aData};
+
+    std::chrono::steady_clock::time_point lStart{std::chrono::steady_clock::now()};
+    mLastYield = lStart;
+
+    switch (lCommand.Command()) {
+        case HostFsOpen:
+            lReturn = HandleOpen(aData);
+            break;
+        case HostFsClose:
+            lReturn = HandleClose(aData);
+            break;
+        case HostFsRead:
+            lReturn = HandleRead(aData);
+            break;
+        case HostFsWrite:
+            lReturn = HandleWrite(aData);
+            break;
+        case HostFsLseek:
+            lReturn = HandleLseek(aData);
+            break;
+        case HostFsDOpen:
+            lReturn = HandleDOpen(aData);
+            break;
+        case HostFsDRead:
+            lReturn = HandleDRead(aData);
+            break;
+        case HostFsDClose:
+            lReturn = HandleDClose(aData);
+            break;
+        case HostFsBye:
+            Reset();
+            break;
+        default:
+            Logger::GetInstance().Log("HostFS command not supported: " + std::to_string(lCommand.Command()),
+                                      Logger::Level::DEBUG);
+            lReturn = Reply(lCommand.Command(), cErrorAccess);
+            break;
+    }
+
+    std::chrono::steady_clock::time_point lEnd{std::chrono::steady_clock::now()};
+    mTransferTime += lEnd - lStart;
+    mLongestStall = std::max(mLongestStall, std::chrono::nanoseconds(lEnd - mLastYield));
+
+    return lReturn;
+}
+
+void HostFSServer::Reset()
+{
+    mFiles.clear();
+    mDirectories.clear();
+}
+
+void HostFSServer::LogStatistics() const
+{
+    if (mBytesRead > 0 || mBytesWritten > 0) {
+        double lSeconds{std::chrono::duration<double>(mTransferTime).count()};
+        Logger::GetInstance().Log(
+            "HostFS: " + std::to_string(mBytesRead) + " bytes read, " + std::to_string(mBytesWritten) +
+                " bytes written, " +
+                std::to_string(static_cast<uint64_t>(
+                    lSeconds > 0 ? static_cast<double>(mBytesRead + mBytesWritten) / lSeconds / 1024 : 0)) +
+                " KiB/s, frames for the PSP waited at most " +
+                std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(mLongestStall).count()) + " us",
+            Logger::Level::INFO);
+    }
+}
+
+bool HostFSServer::ReadExtra(uint32_t aSize, std::vector<char>& aData)
+{
+    bool lReturn{true};
+    aData.resize(aSize);
+
+    // The PSP sends the data right after the command
+    for (uint32_t lOffset = 0; lOffset < aSize && lReturn;) {
+        int lLength{mRead(aData.data() + lOffset, std::min(cChunkSize, static_cast<int>(aSize - lOffset)))};
+        if (lLength > 0) {
+            lOffset += static_cast<uint32_t>(lLength);
+            Yield();
+        } else {
+            Logger::GetInstance().Log("Could not read HostFS data from the PSP", Logger::Level::ERROR);
+            lReturn = false;
+        }
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::WriteChunked(char* aData, int aSize)
+{
+    bool lReturn{true};
+
+    for (int lOffset = 0; lOffset < aSize && lReturn;) {
+        int lLength{mWrite(aData + lOffset, std::min(cChunkSize, aSize - lOffset))};
+        if (lLength > 0) {
+            lOffset += lLength;
+            Yield();
+        } else {
+            Logger::GetInstance().Log("Could not write HostFS data to the PSP", Logger::Level::ERROR);
+            lReturn = false;
+        }
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::Reply(uint32_t aCommand, int32_t aResult, uint32_t aExtraLength)
+{
+    HostFsResp lResponse{{HostFS, aCommand, aExtraLength}, aResult};
+    return mWrite(reinterpret_cast<char*>(&lResponse), sizeof(lResponse)) == sizeof(lResponse);
+}
+
+void HostFSServer::Yield()
+{
+    std::chrono::steady_clock::time_point lNow{std::chrono::steady_clock::now()};
+    mLongestStall = std::max(mLongestStall, std::chrono::nanoseconds(lNow - mLastYield));
+
+    if (mYield != nullptr) {
+        mYield();
+    }
+    mLastYield = std::chrono::steady_clock::now();
+}
+
+bool HostFSServer::ResolvePath(std::string_view aPath, std::filesystem::path& aResult) const
+{
+    bool             lReturn{true};
+    std::string_view lPath{aPath.substr(0, aPath.find('\0'))};
+
+    // Leave out the device, e.g. host0:
+    std::size_t lDevice{lPath.find(':')};
+    if (lDevice != std::string_view::npos) {
+        lPath.remove_prefix(lDevice + 1);
+    }
+
+    std::filesystem::path lRelative{std::filesystem::path(lPath).relative_path()};
+    for (const auto& lPart : lRelative) {
+        if (lPart == "..") {
+            lReturn = false;
+        }
+    }
+
+    if (lReturn) {
+        // Symbolic links inside the root may still point out of it, so check where the path really ends up
+        std::error_code       lError{};
+        std::filesystem::path lResolved{std::filesystem::weakly_canonical(mRoot / lRelative, lError)};
+        lReturn = !lError &&
+                  std::mismatch(mRoot.begin(), mRoot.end(), lResolved.begin(), lResolved.end()).first == mRoot.end();
+        if (lReturn) {
+            aResult = lResolved;
+        }
+    }
+
+    if (!lReturn) {
+        Logger::GetInstance().Log("PSP tried to get out of the HostFS root: " + std::string(lPath),
+                                  Logger::Level::WARNING);
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::HandleOpen(std::string_view aData)
+{
+    bool          lReturn{false};
+    HostFsOpenCmd lCommand{};
+    int32_t       lResult{cErrorNoEntry};
+
+    if (ParseCommand(aData, lCommand) && lCommand.cmd.extralen <= cMaxPathLength &&
+        ReadExtra(lCommand.cmd.extralen, mBuffer)) {
+        std::filesystem::path lPath{};
+        if (mFiles.size() >= cMaxOpenFiles) {
+            lResult = cErrorTooManyFiles;
+        } else if (ResolvePath(std::string_view(mBuffer.data(), mBuffer.size()), lPath)) {
+            std::ios::openmode lMode{std::ios::binary};
+            if ((lCommand.mode & cOpenRead) != 0) {
+                lMode |= std::ios::in;
+            }
+            if ((lCommand.mode & cOpenWrite) != 0) {
+                lMode |= std::ios::out;
+                lMode |= ((lCommand.mode & cOpenAppend) != 0) ? std::ios::app : std::ios::openmode{};
+                lMode |= ((lCommand.mode & cOpenTruncate) != 0) ? std::ios::trunc : std::ios::openmode{};
+                if ((lCommand.mode & (cOpenAppend | cOpenTruncate)) == 0) {
+                    // Writing only would throw away what is in the file
+                    lMode |= std::ios::in;
+                }
+            }
+
+            std::error_code lError{};
+            bool            lExists{std::filesystem::exists(lPath, lError)};
+            if (!lExists && (lCommand.mode & cOpenCreate) != 0) {
+                // fstream only creates files when not reading from them, so create it first
+                std::ofstream{lPath, std::ios::binary};
+                lExists = std::filesystem::exists(lPath, lError);
+            }
+
+            if (lExists) {
+                auto lFile{std::make_unique<std::fstream>(lPath, lMode)};
+                if (lFile->is_open()) {
+                    lResult         = mNextId++;
+                    mFiles[lResult] = std::move(lFile);
+                } else {
+                    lResult = cErrorAccess;
+                }
+            }
+        }
+        lReturn = Reply(HostFsOpen, lResult);
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::HandleClose(std::string_view aData)
+{
+    bool        lReturn{false};
+    HostFsIdCmd lCommand{};
+
+    if (ParseCommand(aData, lCommand)) {
+        lReturn = Reply(HostFsClose, mFiles.erase(lCommand.fid) > 0 ? 0 : cErrorBadFile);
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::HandleRead(std::string_view aData)
+{
+    bool          lReturn{false};
+    HostFsReadCmd lCommand{};
+
+    if (ParseCommand(aData, lCommand)) {
+        auto lFile{mFiles.find(lCommand.fid)};
+        if (lFile != mFiles.end() && lCommand.len >= 0) {
+            std::fstream& lStream{*lFile->second};
+            lStream.clear();
+            mBuffer.resize(static_cast<std::size_t>(std::min(lCommand.len, cMaxTransferSize)));
+            lStream.read(mBuffer.data(), static_cast<std::streamsize>(mBuffer.size()));
+            auto lLength{static_cast<int32_t>(lStream.gcount())};
+
+            lReturn = Reply(HostFsRead, lLength, static_cast<uint32_t>(lLength)) &&
+                      WriteChunked(mBuffer.data(), lLength);
+            mBytesRead += static_cast<uint64_t>(lLength);
+        } else {
+            lReturn = Reply(HostFsRead, cErrorBadFile);
+        }
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::HandleWrite(std::string_view aData)
+{
+    bool        lReturn{false};
+    HostFsIdCmd lCommand{};
+
+    if (ParseCommand(aData, lCommand) && lCommand.cmd.extralen <= cMaxTransferSize &&
+        ReadExtra(lCommand.cmd.extralen, mBuffer)) {
+        auto lFile{mFiles.find(lCommand.fid)};
+        if (lFile != mFiles.end()) {
+            std::fstream& lStream{*lFile->second};
+            lStream.clear();
+            lStream.write(mBuffer.data(), static_cast<std::streamsize>(mBuffer.size()));
+            lReturn = Reply(HostFsWrite, lStream.good() ? static_cast<int32_t>(mBuffer.size()) : cErrorAccess);
+            mBytesWritten += lStream.good() ? mBuffer.size() : 0;
+        } else {
+            lReturn = Reply(HostFsWrite, cErrorBadFile);
+        }
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::HandleLseek(std::string_view aData)
+{
+    bool           lReturn{false};
+    HostFsLseekCmd lCommand{};
+
+    if (ParseCommand(aData, lCommand)) {
+        HostFsLseekResp lResponse{{HostFS, HostFsLseek, 0}, cErrorBadFile, 0};
+        auto            lFile{mFiles.find(lCommand.fid)};
+        if (lFile != mFiles.end() && lCommand.whence >= 0 && lCommand.whence <= 2) {
+            constexpr std::array<std::ios::seekdir, 3> cDirections{std::ios::beg, std::ios::cur, std::ios::end};
+            std::fstream&                              lStream{*lFile->second};
+            lStream.clear();
+            // There is only one position for both reading and writing in a file stream
+            lStream.seekg(lCommand.ofs, cDirections.at(static_cast<std::size_t>(lCommand.whence)));
+            if (lStream.good()) {
+                lResponse.res = 0;
+                lResponse.ofs = lStream.tellg();
+            }
+        }
+        lReturn = mWrite(reinterpret_cast<char*>(&lResponse), sizeof(lResponse)) == sizeof(lResponse);
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::HandleDOpen(std::string_view aData)
+{
+    bool           lReturn{false};
+    HostFsDOpenCmd lCommand{};
+    int32_t        lResult{cErrorNoEntry};
+
+    if (ParseCommand(aData, lCommand) && lCommand.cmd.extralen <= cMaxPathLength &&
+        ReadExtra(lCommand.cmd.extralen, mBuffer)) {
+        std::filesystem::path lPath{};
+        if (mDirectories.size() >= cMaxOpenFiles) {
+            lResult = cErrorTooManyFiles;
+        } else if (ResolvePath(std::string_view(mBuffer.data(), mBuffer.size()), lPath)) {
+            std::error_code                     lError{};
+            std::filesystem::directory_iterator lDirectory{lPath, lError};
+            if (!lError) {
+                lResult               = mNextId++;
+                mDirectories[lResult] = std::move(lDirectory);
+            }
+        }
+        lReturn = Reply(HostFsDOpen, lResult);
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::HandleDRead(std::string_view aData)
+{
+    bool        lReturn{false};
+    HostFsIdCmd lCommand{};
+
+    if (ParseCommand(aData, lCommand)) {
+        auto lDirectory{mDirectories.find(lCommand.fid)};
+        if (lDirectory == mDirectories.end()) {
+            lReturn = Reply(HostFsDRead, cErrorBadFile);
+        } else if (lDirectory->second == std::filesystem::directory_iterator()) {
+            // No more entries
+            lReturn = Reply(HostFsDRead, 0);
+        } else {
+            const std::filesystem::directory_entry& lEntry{*lDirectory->second};
+            std::error_code                         lError{};
+            PspIoDirent                             lDirent{};
+            bool                                    lIsDirectory{lEntry.is_directory(lError)};
+
+            lDirent.stat.mode = cModeAccess | (lIsDirectory ? cModeDirectory : cModeFile);
+            lDirent.stat.attr = lIsDirectory ? cAttributeDirectory : cAttributeFile;
+            lDirent.stat.size = lIsDirectory ? 0 : static_cast<int64_t>(lEntry.file_size(lError));
+            lDirent.stat.mtime = ToPspDateTime(lEntry.last_write_time(lError));
+            lDirent.stat.ctime = lDirent.stat.mtime;
+            lDirent.stat.atime = lDirent.stat.mtime;
+
+            std::string lName{lEntry.path().filename().string()};
+            std::strncpy(lDirent.name, lName.c_str(), sizeof(lDirent.name) - 1);
+
+            lDirectory->second.increment(lError);
+            if (lError) {
+                lDirectory->second = std::filesystem::directory_iterator();
+            }
+
+            lReturn = Reply(HostFsDRead, 1, sizeof(lDirent)) &&
+                      mWrite(reinterpret_cast<char*>(&lDirent), sizeof(lDirent)) == sizeof(lDirent);
+        }
+    }
+
+    return lReturn;
+}
+
+bool HostFSServer::HandleDClose(std::string_view aData)
+{
+    bool        lReturn{false};
+    HostFsIdCmd lCommand{};
+
+    if (ParseCommand(aData, lCommand)) {
+        lReturn = Reply(HostFsDClose, mDirectories.erase(lCommand.fid) > 0 ? 0 : cErrorBadFile);
+    }
+
+    return lReturn;
+}
@@ -0,0 +1,106 @@
+#include "../Includes/LocalSwitch.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - LocalSwitch.cpp */
+
+#include <string>
+
+#include "../Includes/Logger.h"
+#include "../Includes/NetConversionFunctions.h"
+#include "../Includes/NetworkingHeaders.h"
+#include "../Includes/USBReader.h"
+#include "../Includes/XLinkKaiConnection.h"
+
+namespace
+{
+    // Weight of a new measurement in the average local hop time.
+    constexpr double cHopTimeWeight{0.125};
+}  // namespace
+
+LocalSwitch::LocalSwitch(std::shared_ptr<XLinkKaiConnection> aConnection) : mConnection(std::move(aConnection)) {}
+
+void LocalSwitch::AddDevice(std::shared_ptr<USBReader> aDevice)
+{
+    mDevices.push_back(std::move(aDevice));
+}
+
+void LocalSwitch::Send(USBReader& aSource, std::string_view aData)
+{
+    bool lToConnection{true};
+
+    if (mDevices.size() > 1 && aData.size() >= Net_8023_Constants::cHeaderLength) {
+        std::chrono::steady_clock::time_point lStart{std::chrono::steady_clock::now()};
+
+        uint64_t lSource{GetMacAddress(aData, Net_8023_Constants::cSourceAddressIndex)};
+        uint64_t lDestination{GetMacAddress(aData, Net_8023_Constants::cDestinationAddressIndex)};
+
+        USBReader* lTarget{nullptr};
+        {
+            std::lock_guard<std::mutex> lLock{mMutex};
+            if (!IsGroupAddress(lSource)) {
+                mMacTable[lSource] = &aSource;
+            }
+
+            if (!IsGroupAddress(lDestination)) {
+                auto lEntry{mMacTable.find(lDestination)};
+                if (lEntry != mMacTable.end() && lEntry->second != &aSource) {
+                    lTarget = lEntry->second;
+                }
+            }
+        }
+
+        if (IsGroupAddress(lDestination)) {
+            // Everyone gets a copy, including XLink Kai
+            for (auto& lDevice : mDevices) {
+                if (lDevice.get() != &aSource) {
+                    lDevice->Send(aData);
+                }
+            }
+        } else if (lTarget != nullptr) {
+            lTarget->Send(aData);
+            lToConnection = false;
+            mLocalFrames++;
+
+            std::chrono::duration<double, std::nano> lHopTime{std::chrono::steady_clock::now() - lStart};
+            std::lock_guard<std::mutex>              lLock{mMutex};
+            mLocalHopTime = (mLocalHopTime > 0) ? (mLocalHopTime + cHopTimeWeight * (lHopTime.count() - mLocalHopTime))
+                                                : lHopTime.count();
+        }
+    }
+
+    if (lToConnection) {
+        if (mConnection->IsConnected()) {
+            mRemoteFrames++;
+            mConnection->Send(aData);
+        } else {
+            mDroppedFrames++;
+        }
+    }
+}
+
+bool LocalSwitch::IsForwarding() const
+{
+    return mDevices.size() > 1 || mConnection->IsConnected();
+}
+
+XLinkKaiConnection& LocalSwitch::GetConnection() const
+{
+    return *mConnection;
+}
+
+void LocalSwitch::LogStatistics() const
+{
+    std::lock_guard<std::mutex> lLock{mMutex};
+    if (mLocalFrames > 0) {
+        Logger::GetInstance().Log("Frames switched locally: " + std::to_string(mLocalFrames) + ", through XLink Kai: " +
+                                      std::to_string(mRemoteFrames) + ", local hop: " +
+                                      std::to_string(static_cast<int64_t>(mLocalHopTime / 1000)) +
+                                      " us, XLink Kai round trip: " +
+                                      std::to_string(mConnection->GetRoundTripTime().count()) + " us",
+                                  Logger::Level::INFO);
+    }
+
+    if (mDroppedFrames > 0) {
+        Logger::GetInstance().Log("Frames dropped while XLink Kai was not connected: " + std::to_string(mDroppedFrames),
+                                  Logger::Level::INFO);
+    }
+}
@@ -0,0 +1,78 @@
+#include "../Includes/MacFilter.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - MacFilter.cpp */
+
+#include <string>
+
+#include "../Includes/Logger.h"
+#include "../Includes/NetConversionFunctions.h"
+#include "../Includes/NetworkingHeaders.h"
+
+using namespace MacFilter_Constants;
+
+void MacFilter::Learn(std::string_view aFrame)
+{
+    if (aFrame.size() >= Net_8023_Constants::cHeaderLength) {
+        uint64_t lSource{GetMacAddress(aFrame, Net_8023_Constants::cSourceAddressIndex)};
+
+        if (!IsGroupAddress(lSource)) {
+            std::size_t lCount{mMacCount.load(std::memory_order_relaxed)};
+            bool        lKnown{false};
+            for (std::size_t lIndex = 0; lIndex < lCount && !lKnown; lIndex++) {
+                lKnown = mMacs.at(lIndex).load(std::memory_order_relaxed) == lSource;
+            }
+
+            if (!lKnown) {
+                // Replace the oldest one when full
+                mMacs.at(mNextSlot).store(lSource, std::memory_order_relaxed);
+                mNextSlot = (mNextSlot + 1) % cMaxLearnedMacs;
+                if (lCount < cMaxLearnedMacs) {
+                    mMacCount.store(lCount + 1, std::memory_order_release);
+                }
+
+                Logger::GetInstance().Log("Learned PSP address: " + MacToString(lSource), Logger::Level::DEBUG);
+            }
+        }
+    }
+}
+
+void MacFilter::Clear()
+{
+    mMacCount.store(0, std::memory_order_release);
+    mNextSlot = 0;
+}
+
+bool MacFilter::ShouldForward(std::string_view aFrame)
+{
+    bool lReturn{true};
+
+    std::size_t lCount{mMacCount.load(std::memory_order_acquire)};
+    if (lCount > 0 && aFrame.size() >= Net_8023_Constants::cHeaderLength) {
+        uint64_t lDestination{GetMacAddress(aFrame, Net_8023_Constants::cDestinationAddressIndex)};
+
+        if (!IsGroupAddress(lDestination)) {
+            lReturn = false;
+            for (std::size_t lIndex = 0; lIndex < lCount && !lReturn; lIndex++) {
+                lReturn = mMacs.at(lIndex).load(std::memory_order_relaxed) == lDestination;
+            }
+        }
+    }
+
+    if (lReturn) {
+        mForwardedCount.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        mFilteredCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return lReturn;
+}
+
+uint64_t MacFilter::GetForwardedCount() const
+{
+    return mForwardedCount.load(std::memory_order_relaxed);
+}
+
+uint64_t MacFilter::GetFilteredCount() const
+{
+    return mFilteredCount.load(std::memory_order_relaxed);
+}
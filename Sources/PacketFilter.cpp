@@ -0,0 +1,296 @@
+#include "../Includes/PacketFilter.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - PacketFilter.cpp */
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+
+#include "../Includes/Logger.h"
+#include "../Includes/NetworkingHeaders.h"
+
+using namespace PacketFilter_Constants;
+
+namespace
+{
+    constexpr uint32_t cPcapMagic{0xa1b2c3d4};
+    constexpr uint16_t cPcapVersionMajor{2};
+    constexpr uint16_t cPcapVersionMinor{4};
+    constexpr uint32_t cPcapSnapLength{65535};
+    constexpr uint32_t cPcapLinkTypeEthernet{1};
+
+    PACK(struct PcapHeader {
+        uint32_t magic;
+        uint16_t versionMajor;
+        uint16_t versionMinor;
+        int32_t  thisZone;
+        uint32_t sigFigs;
+        uint32_t snapLength;
+        uint32_t linkType;
+    });
+
+    PACK(struct PcapRecordHeader {
+        uint32_t seconds;
+        uint32_t microseconds;
+        uint32_t capturedLength;
+        uint32_t length;
+    });
+}  // namespace
+
+/**
+ * Converts a string of hex digits, optionally separated by ':', to bytes.
+ * @param aHex - The hex string.
+ * @param aBytes - Where to put the bytes.
+ * @return true if successful.
+ */
+static bool HexToBytes(std::string_view aHex, std::string& aBytes)
+{
+    bool        lReturn{true};
+    std::string lDigits{};
+    std::copy_if(aHex.begin(), aHex.end(), std::back_inserter(lDigits), [](char aCharacter) {
+        return aCharacter != ':';
+    });
+
+    if (lDigits.empty() || (lDigits.size() % 2) != 0) {
+        lReturn = false;
+    }
+
+    for (std::size_t lIndex = 0; lIndex < lDigits.size() && lReturn; lIndex += 2) {
+        uint8_t lByte{0};
+        auto [lEnd, lError] = std::from_chars(lDigits.data() + lIndex, lDigits.data() + lIndex + 2, lByte, 16);
+        lReturn             = (lError == std::errc() && lEnd == lDigits.data() + lIndex + 2);
+        aBytes.push_back(static_cast<char>(lByte));
+    }
+
+    return lReturn;
+}
+
+/**
+ * Converts a decimal number.
+ * @param aNumber - The number as string.
+ * @param aValue - Where to put the number.
+ * @return true if successful.
+ */
+static bool ToNumber(std::string_view aNumber, std::size_t& aValue)
+{
+    auto [lEnd, lError] = std::from_chars(aNumber.data(), aNumber.data() + aNumber.size(), aValue);
+    return lError == std::errc() && lEnd == aNumber.data() + aNumber.size();
+}
+
+void PacketFilter::AddTests(std::size_t aOffset, std::string_view aBytes, Rule& aRule)
+{
+    for (std::size_t lIndex = 0; lIndex < aBytes.size(); lIndex += sizeof(uint64_t)) {
+        Test lTest{};
+        lTest.offset = static_cast<uint16_t>(aOffset + lIndex);
+        lTest.length = static_cast<uint8_t>(std::min(sizeof(uint64_t), aBytes.size() - lIndex));
+        std::memcpy(&lTest.value, aBytes.data() + lIndex, lTest.length);
+        mTests.push_back(lTest);
+        aRule.testCount++;
+    }
+    // No need to check bounds per test when the frame is long enough for all of them
+    aRule.minLength = std::max(aRule.minLength, aOffset + aBytes.size());
+}
+
+bool PacketFilter::CompileCondition(std::string_view aCondition, Rule& aRule)
+{
+    bool        lReturn{true};
+    std::string lBytes{};
+    std::size_t lNumber{0};
+
+    if (aCondition == "any") {
+        // Nothing to test
+    } else if (aCondition.starts_with("ethertype=")) {
+        lReturn = HexToBytes(aCondition.substr(10), lBytes) && lBytes.size() == Net_8023_Constants::cEtherTypeLength;
+        AddTests(Net_8023_Constants::cEtherTypeIndex, lBytes, aRule);
+    } else if (aCondition.starts_with("src=")) {
+        lReturn = HexToBytes(aCondition.substr(4), lBytes) && lBytes.size() == Net_8023_Constants::cSourceAddressLength;
+        AddTests(Net_8023_Constants::cSourceAddressIndex, lBytes, aRule);
+    } else if (aCondition.starts_with("dst=")) {
+        lReturn =
+            HexToBytes(aCondition.substr(4), lBytes) && lBytes.size() == Net_8023_Constants::cDestinationAddressLength;
+        AddTests(Net_8023_Constants::cDestinationAddressIndex, lBytes, aRule);
+    } else if (aCondition.starts_with("len") && aCondition.size() > 4) {
+        lReturn = ToNumber(aCondition.substr(4), lNumber);
+        switch (aCondition.at(3)) {
+            case '<':
+                aRule.maxLength = std::min(aRule.maxLength, lNumber > 0 ? lNumber - 1 : 0);
+                break;
+            case '>':
+                aRule.minLength = std::max(aRule.minLength, lNumber + 1);
+                break;
+            case '=':
+                aRule.minLength = std::max(aRule.minLength, lNumber);
+                aRule.maxLength = std::min(aRule.maxLength, lNumber);
+                break;
+            default:
+                lReturn = false;
+        }
+    } else if (aCondition.starts_with("@") && aCondition.find('=') != std::string_view::npos) {
+        std::size_t lSeparator{aCondition.find('=')};
+        lReturn = ToNumber(aCondition.substr(1, lSeparator - 1), lNumber) &&
+                  HexToBytes(aCondition.substr(lSeparator + 1), lBytes) && lNumber < UINT16_MAX;
+        if (lReturn) {
+            AddTests(lNumber, lBytes, aRule);
+        }
+    } else {
+        lReturn = false;
+    }
+
+    return lReturn;
+}
+
+bool PacketFilter::Compile(std::string_view aRules)
+{
+    bool lReturn{true};
+    mTests.clear();
+    mRules.clear();
+
+    std::string_view lRules{aRules};
+    while (!lRules.empty() && lReturn) {
+        std::size_t      lEnd{std::min(lRules.find(cRuleSeparator), lRules.size())};
+        std::string_view lRuleText{lRules.substr(0, lEnd)};
+        lRules.remove_prefix(std::min(lEnd + cRuleSeparator.size(), lRules.size()));
+
+        if (!lRuleText.empty()) {
+            Rule        lRule{};
+            std::size_t lActionIndex{lRuleText.rfind(cActionSeparator)};
+            lReturn = lActionIndex != std::string_view::npos;
+
+            if (lReturn) {
+                std::string_view lAction{lRuleText.substr(lActionIndex + cActionSeparator.size())};
+                auto             lFound{std::find(cActionTexts.begin(), cActionTexts.end(), lAction)};
+                lReturn = lFound != cActionTexts.end();
+                if (lReturn) {
+                    lRule.action = static_cast<Action>(std::distance(cActionTexts.begin(), lFound));
+                }
+            }
+
+            std::string_view lConditions{lRuleText.substr(0, lActionIndex)};
+            lRule.firstTest = mTests.size();
+            while (!lConditions.empty() && lReturn) {
+                std::size_t lConditionEnd{std::min(lConditions.find(cConditionSeparator), lConditions.size())};
+                lReturn = CompileCondition(lConditions.substr(0, lConditionEnd), lRule);
+                lConditions.remove_prefix(std::min(lConditionEnd + cConditionSeparator.size(), lConditions.size()));
+            }
+
+            if (lReturn) {
+                lRule.text = lRuleText;
+                mRules.push_back(lRule);
+            } else {
+                Logger::GetInstance().Log("Could not compile filter rule: " + std::string(lRuleText),
+                                          Logger::Level::ERROR);
+            }
+        }
+    }
+
+    if (!lReturn) {
+        mTests.clear();
+        mRules.clear();
+    }
+
+    mMatches = std::make_unique<std::atomic<uint64_t>[]>(mRules.size());
+    return lReturn;
+}
+
+bool PacketFilter::SetCaptureFile(const std::string& aPath)
+{
+    bool                        lReturn{true};
+    std::lock_guard<std::mutex> lLock{mCaptureMutex};
+
+    if (mCaptureFile.is_open()) {
+        mCaptureFile.close();
+    }
+
+    if (!aPath.empty()) {
+        mCaptureFile.open(aPath, std::ios::binary | std::ios::trunc);
+        if (mCaptureFile.is_open()) {
+            PcapHeader lHeader{
+                cPcapMagic, cPcapVersionMajor, cPcapVersionMinor, 0, 0, cPcapSnapLength, cPcapLinkTypeEthernet};
+            mCaptureFile.write(reinterpret_cast<const char*>(&lHeader), sizeof(lHeader));
+        } else {
+            Logger::GetInstance().Log("Could not open capture file: " + aPath, Logger::Level::ERROR);
+            lReturn = false;
+        }
+    }
+
+    return lReturn;
+}
+
+void PacketFilter::Capture(std::string_view aFrame)
+{
+    std::lock_guard<std::mutex> lLock{mCaptureMutex};
+    if (mCaptureFile.is_open()) {
+        std::chrono::microseconds lNow{std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch())};
+        PcapRecordHeader lHeader{static_cast<uint32_t>(lNow.count() / 1000000),
+                                 static_cast<uint32_t>(lNow.count() % 1000000),
+                                 static_cast<uint32_t>(aFrame.size()),
+                                 static_cast<uint32_t>(aFrame.size())};
+        mCaptureFile.write(reinterpret_cast<const char*>(&lHeader), sizeof(lHeader));
+        mCaptureFile.write(aFrame.data(), static_cast<std::streamsize>(aFrame.size()));
+        mCaptureFile.flush();
+    }
+}
+
+bool PacketFilter::ShouldForward(std::string_view aFrame)
+{
+    bool lReturn{true};
+
+    for (std::size_t lRuleIndex = 0; lRuleIndex < mRules.size(); lRuleIndex++) {
+        const Rule& lRule{mRules[lRuleIndex]};
+        bool        lMatch{aFrame.size() >= lRule.minLength && aFrame.size() <= lRule.maxLength};
+
+        for (std::size_t lTestIndex = 0; lTestIndex < lRule.testCount && lMatch; lTestIndex++) {
+            const Test& lTest{mTests[lRule.firstTest + lTestIndex]};
+            uint64_t    lValue{0};
+            std::memcpy(&lValue, aFrame.data() + lTest.offset, lTest.length);
+            lMatch = lValue == lTest.value;
+        }
+
+        if (lMatch) {
+            mMatches[lRuleIndex].fetch_add(1, std::memory_order_relaxed);
+            if (lRule.action == Action::Drop) {
+                lReturn = false;
+            } else if (lRule.action == Action::Tag) {
+                Capture(aFrame);
+            }
+            break;
+        }
+    }
+
+    return lReturn;
+}
+
+std::size_t PacketFilter::Filter(std::span<std::string_view> aFrames)
+{
+    std::size_t lReturn{0};
+
+    if (mRules.empty()) {
+        lReturn = aFrames.size();
+    } else {
+        for (std::string_view& lFrame : aFrames) {
+            if (ShouldForward(lFrame)) {
+                aFrames[lReturn] = lFrame;
+                lReturn++;
+            }
+        }
+    }
+
+    return lReturn;
+}
+
+bool PacketFilter::IsEmpty() const
+{
+    return mRules.empty();
+}
+
+void PacketFilter::LogStatistics(std::string_view aName) const
+{
+    for (std::size_t lRuleIndex = 0; lRuleIndex < mRules.size(); lRuleIndex++) {
+        Logger::GetInstance().Log(std::string(aName) + " rule " + mRules[lRuleIndex].text + ": " +
+                                      std::to_string(mMatches[lRuleIndex].load(std::memory_order_relaxed)) +
+                                      " matches",
+                                  Logger::Level::INFO);
+    }
+}
@@ -1,5 +1,6 @@
 #include "../Includes/SettingsModel.h"
 
+#include <algorithm>
 #include <cstddef>
 
 /* Copyright (c) 2020 [Rick de Bondt] - SettingsModel.cpp */
@@ -22,6 +23,26 @@ bool StringToBool(std::string_view aString)
     return lReturn;
 }
 
+/**
+ * Checks if an option holds a path, those may contain spaces.
+ * @param aOption - The option.
+ * @return true if it does.
+ */
+static bool IsPathOption(std::string_view aOption)
+{
+    return aOption == cSaveHostFSRoot || aOption == cSavePSPDebugLog || aOption == cSaveFilterCaptureFile;
+}
+
+/**
+ * Removes whitespace from both ends of a string.
+ * @param aString - The string to trim.
+ */
+static void Trim(std::string& aString)
+{
+    aString.erase(aString.begin(), std::find_if_not(aString.begin(), aString.end(), isspace));
+    aString.erase(std::find_if_not(aString.rbegin(), aString.rend(), isspace).base(), aString.end());
+}
+
 bool SettingsModel::SaveToFile(std::string_view aPath) const
 {
     bool          lReturn{false};
@@ -30,13 +51,31 @@ bool SettingsModel::SaveToFile(std::string_view aPath) const
 
     if (lFile.is_open() && lFile.good()) {
         lFile << cSaveLogLevel << ": \"" << Logger::ConvertLogLevelToString(mLogLevel) << "\"" << std::endl;
+        lFile << cSaveAutoDiscoverXLinkKai << ": \"" << BoolToString(mAutoDiscoverXLinkKai) << "\"" << std::endl;
         lFile << cSaveXLinkIp << ": \"" << mXLinkIp << "\"" << std::endl;
         lFile << cSaveXLinkPort << ": \"" << mXLinkPort << "\"" << std::endl;
+        lFile << cSaveXLinkFallbacks << ": \"" << mXLinkFallbacks << "\"" << std::endl;
+        lFile << cSaveXLinkFailoverTimeoutMS << ": \"" << std::to_string(mXLinkFailoverTimeoutMS) << "\""
+              << std::endl;
         lFile << cSaveMaxBufferedMessages << ": \"" << std::to_string(mMaxBufferedMessages) << "\"" << std::endl;
         lFile << cSaveMaxFatalRetries << ": \"" << std::to_string(mMaxFatalRetries) << "\"" << std::endl;
         lFile << cSaveMaxReadWriteRetries << ": \"" << std::to_string(mMaxReadWriteRetries) << "\"" << std::endl;
         lFile << cSaveReadTimeOutMS << ": \"" << std::to_string(mReadTimeOutMS) << "\"" << std::endl;
         lFile << cSaveWriteTimeOutMS << ": \"" << std::to_string(mWriteTimeOutMS) << "\"" << std::endl;
+        lFile << cSaveUSBPacing << ": \"" << BoolToString(mUSBPacing) << "\"" << std::endl;
+        lFile << cSaveUSBSendScheduler << ": \"" << mUSBSendScheduler << "\"" << std::endl;
+        lFile << cSaveUSBSmallFrameThreshold << ": \"" << std::to_string(mUSBSmallFrameThreshold) << "\""
+              << std::endl;
+        lFile << cSaveUSBMacFilter << ": \"" << BoolToString(mUSBMacFilter) << "\"" << std::endl;
+        lFile << cSaveBroadcastRateLimit << ": \"" << std::to_string(mBroadcastRateLimit) << "\"" << std::endl;
+        lFile << cSaveDuplicateWindowMS << ": \"" << std::to_string(mDuplicateWindowMS) << "\"" << std::endl;
+        lFile << cSaveMaxPSPs << ": \"" << std::to_string(mMaxPSPs) << "\"" << std::endl;
+        lFile << cSaveFilterToPSP << ": \"" << mFilterToPSP << "\"" << std::endl;
+        lFile << cSaveFilterFromPSP << ": \"" << mFilterFromPSP << "\"" << std::endl;
+        lFile << cSaveFilterCaptureFile << ": \"" << mFilterCaptureFile << "\"" << std::endl;
+        lFile << cSavePSPDebugLog << ": \"" << mPSPDebugLog << "\"" << std::endl;
+        lFile << cSaveHostFSRoot << ": \"" << mHostFSRoot << "\"" << std::endl;
+        lFile << cSaveUSBAggregation << ": \"" << BoolToString(mUSBAggregation) << "\"" << std::endl;
 
         lFile.close();
 
@@ -67,19 +106,31 @@ bool SettingsModel::LoadFromFile(std::string_view aPath)
         while (lContinue && !lFile.eof() && lFile.good()) {
             getline(lFile, lLine);
             if (!lFile.eof() && lFile.good()) {
-                lLine.erase(remove_if(lLine.begin(), lLine.end(), isspace), lLine.end());
                 size_t      lUntilDelimiter = lLine.find(':');
                 std::string lOption{lLine.substr(0, lUntilDelimiter)};
                 std::string lResult{lLine.substr(lUntilDelimiter + 1, lLine.size() - lUntilDelimiter - 1)};
+                lOption.erase(remove_if(lOption.begin(), lOption.end(), isspace), lOption.end());
+                if (IsPathOption(lOption)) {
+                    // Only around the quotes, spaces in a path are part of it
+                    Trim(lResult);
+                } else {
+                    lResult.erase(remove_if(lResult.begin(), lResult.end(), isspace), lResult.end());
+                }
                 try {
                     if (!lResult.empty()) {
                         // TODO: rewrite to switch case
                         if (lOption == cSaveLogLevel) {
                             mLogLevel = Logger::ConvertLogLevelStringToLevel(lResult.substr(1, lResult.size() - 2));
+                        } else if (lOption == cSaveAutoDiscoverXLinkKai) {
+                            mAutoDiscoverXLinkKai = StringToBool(lResult.substr(1, lResult.size() - 2));
                         } else if (lOption == cSaveXLinkIp) {
                             mXLinkIp = lResult.substr(1, lResult.size() - 2);
                         } else if (lOption == cSaveXLinkPort) {
                             mXLinkPort = lResult.substr(1, lResult.size() - 2);
+                        } else if (lOption == cSaveXLinkFallbacks) {
+                            mXLinkFallbacks = lResult.substr(1, lResult.size() - 2);
+                        } else if (lOption == cSaveXLinkFailoverTimeoutMS) {
+                            mXLinkFailoverTimeoutMS = std::stoi(lResult.substr(1, lResult.size() - 2));
                         } else if (lOption == cSaveMaxBufferedMessages) {
                             mMaxBufferedMessages = std::stoi(lResult.substr(1, lResult.size() - 2));
                         } else if (lOption == cSaveMaxFatalRetries) {
@@ -90,6 +141,32 @@ bool SettingsModel::LoadFromFile(std::string_view aPath)
                             mReadTimeOutMS = std::stoi(lResult.substr(1, lResult.size() - 2));
                         } else if (lOption == cSaveWriteTimeOutMS) {
                             mWriteTimeOutMS = std::stoi(lResult.substr(1, lResult.size() - 2));
+                        } else if (lOption == cSaveUSBPacing) {
+                            mUSBPacing = StringToBool(lResult.substr(1, lResult.size() - 2));
+                        } else if (lOption == cSaveUSBSendScheduler) {
+                            mUSBSendScheduler = lResult.substr(1, lResult.size() - 2);
+                        } else if (lOption == cSaveUSBSmallFrameThreshold) {
+                            mUSBSmallFrameThreshold = std::stoi(lResult.substr(1, lResult.size() - 2));
+                        } else if (lOption == cSaveUSBMacFilter) {
+                            mUSBMacFilter = StringToBool(lResult.substr(1, lResult.size() - 2));
+                        } else if (lOption == cSaveBroadcastRateLimit) {
+                            mBroadcastRateLimit = std::stoi(lResult.substr(1, lResult.size() - 2));
+                        } else if (lOption == cSaveDuplicateWindowMS) {
+                            mDuplicateWindowMS = std::stoi(lResult.substr(1, lResult.size() - 2));
+                        } else if (lOption == cSaveMaxPSPs) {
+                            mMaxPSPs = std::stoi(lResult.substr(1, lResult.size() - 2));
+                        } else if (lOption == cSaveFilterToPSP) {
+                            mFilterToPSP = lResult.substr(1, lResult.size() - 2);
+                        } else if (lOption == cSaveFilterFromPSP) {
+                            mFilterFromPSP = lResult.substr(1, lResult.size() - 2);
+                        } else if (lOption == cSaveFilterCaptureFile) {
+                            mFilterCaptureFile = lResult.substr(1, lResult.size() - 2);
+                        } else if (lOption == cSavePSPDebugLog) {
+                            mPSPDebugLog = lResult.substr(1, lResult.size() - 2);
+                        } else if (lOption == cSaveHostFSRoot) {
+                            mHostFSRoot = lResult.substr(1, lResult.size() - 2);
+                        } else if (lOption == cSaveUSBAggregation) {
+                            mUSBAggregation = StringToBool(lResult.substr(1, lResult.size() - 2));
                         } else {
                             Logger::GetInstance().Log(std::string("Option:") + lOption + " unknown",
                                                       Logger::Level::DEBUG);
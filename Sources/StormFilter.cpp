@@ -0,0 +1,108 @@
+#include "../Includes/StormFilter.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - StormFilter.cpp */
+
+#include <string>
+
+#include "../Includes/Logger.h"
+#include "../Includes/NetConversionFunctions.h"
+#include "../Includes/NetworkingHeaders.h"
+
+using namespace StormFilter_Constants;
+
+namespace
+{
+    constexpr uint64_t cFNVOffsetBasis{0xcbf29ce484222325};
+    constexpr uint64_t cFNVPrime{0x100000001b3};
+}  // namespace
+
+/**
+ * FNV-1a hash, fast and good enough to tell frames apart.
+ * @param aData - Data to hash.
+ * @return The hash.
+ */
+static inline uint64_t HashFrame(std::string_view aData)
+{
+    uint64_t lHash{cFNVOffsetBasis};
+    for (char lCharacter : aData) {
+        lHash ^= static_cast<uint8_t>(lCharacter);
+        lHash *= cFNVPrime;
+    }
+    return lHash;
+}
+
+void StormFilter::SetThresholds(int aBroadcastRate, int aDuplicateWindowMS)
+{
+    mBroadcastRate   = aBroadcastRate;
+    mDuplicateWindow = std::chrono::milliseconds(aDuplicateWindowMS);
+    mSources.clear();
+}
+
+bool StormFilter::IsWithinRate(uint64_t aSource, Clock::time_point aNow)
+{
+    if (mSources.size() >= cMaxTrackedSources && mSources.find(aSource) == mSources.end()) {
+        mSources.clear();
+    }
+
+    // Allows a second worth of frames in one go
+    return mSources.try_emplace(aSource, mBroadcastRate, mBroadcastRate).first->second.TryConsume(1, aNow);
+}
+
+bool StormFilter::IsDuplicate(std::string_view aFrame, Clock::time_point aNow)
+{
+    bool     lReturn{false};
+    uint64_t lHash{HashFrame(aFrame)};
+
+    for (const SeenFrame& lSeenFrame : mSeenFrames) {
+        if (lSeenFrame.hash == lHash && lSeenFrame.length == aFrame.size() &&
+            (aNow - lSeenFrame.time) < mDuplicateWindow) {
+            lReturn = true;
+            break;
+        }
+    }
+
+    if (!lReturn) {
+        mSeenFrames.at(mNextSeenFrame) = {lHash, aFrame.size(), aNow};
+        mNextSeenFrame                 = (mNextSeenFrame + 1) % cDuplicateHistorySize;
+    }
+
+    return lReturn;
+}
+
+bool StormFilter::ShouldForward(std::string_view aFrame)
+{
+    bool lReturn{true};
+
+    if (aFrame.size() >= Net_8023_Constants::cHeaderLength) {
+        Clock::time_point lNow{Clock::now()};
+
+        // Lowest bit of the first octet is set for broadcast and multicast
+        bool lGroup{(aFrame[Net_8023_Constants::cDestinationAddressIndex] & 0x01) != 0};
+        if (lGroup && mBroadcastRate > 0) {
+            uint64_t lSource{GetMacAddress(aFrame, Net_8023_Constants::cSourceAddressIndex)};
+            if (!IsWithinRate(lSource, lNow)) {
+                lReturn = false;
+                if (mRateLimitedCount.fetch_add(1, std::memory_order_relaxed) == 0) {
+                    Logger::GetInstance().Log("Broadcast storm, limiting broadcasts per source", Logger::Level::DEBUG);
+                }
+            }
+        }
+
+        if (lReturn && mDuplicateWindow.count() > 0 && IsDuplicate(aFrame, lNow)) {
+            lReturn = false;
+            mDuplicateCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    return lReturn;
+}
+
+uint64_t StormFilter::GetRateLimitedCount() const
+{
+    return mRateLimitedCount.load(std::memory_order_relaxed);
+}
+
+uint64_t StormFilter::GetDuplicateCount() const
+{
+    return mDuplicateCount.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,54 @@
+#include "../Includes/TokenBucket.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - TokenBucket.cpp */
+
+#include <algorithm>
+
+TokenBucket::TokenBucket(double aRate, double aBurst) : mRate(aRate), mBurst(aBurst), mTokens(aBurst) {}
+
+void TokenBucket::Refill(Clock::time_point aNow)
+{
+    if (aNow > mLastRefill) {
+        std::chrono::duration<double> lElapsed{aNow - mLastRefill};
+        mTokens     = std::min(mBurst, mTokens + (lElapsed.count() * mRate));
+        mLastRefill = aNow;
+    }
+}
+
+bool TokenBucket::TryConsume(double aAmount, Clock::time_point aNow)
+{
+    bool lReturn{true};
+
+    if (!IsUnlimited()) {
+        Refill(aNow);
+        if (mTokens >= aAmount) {
+            mTokens -= aAmount;
+        } else {
+            lReturn = false;
+        }
+    }
+
+    return lReturn;
+}
+
+void TokenBucket::SetRate(double aRate)
+{
+    if (IsUnlimited()) {
+        // Start from a full bucket, instead of from whatever was left when it got unlimited
+        mTokens     = mBurst;
+        mLastRefill = Clock::now();
+    } else {
+        Refill(Clock::now());
+    }
+    mRate = aRate;
+}
+
+double TokenBucket::GetRate() const
+{
+    return mRate;
+}
+
+bool TokenBucket::IsUnlimited() const
+{
+    return mRate <= 0;
+}
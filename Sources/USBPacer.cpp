@@ -0,0 +1,62 @@
+#include "../Includes/USBPacer.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - USBPacer.cpp */
+
+#include <algorithm>
+#include <string>
+
+#include "../Includes/Logger.h"
+
+using namespace USBPacer_Constants;
+
+void USBPacer::SetEnabled(bool aEnabled)
+{
+    mEnabled = aEnabled;
+    if (!mEnabled) {
+        mBucket.SetRate(0);
+    }
+}
+
+bool USBPacer::CanSend(std::size_t aSize)
+{
+    return mBucket.TryConsume(static_cast<double>(aSize));
+}
+
+void USBPacer::OnWriteComplete(std::size_t aBytes, std::chrono::steady_clock::duration aElapsed, bool aTimedOut)
+{
+    std::chrono::duration<double> lElapsed{aElapsed};
+    if (aBytes > 0 && lElapsed.count() > 0) {
+        double lRate{static_cast<double>(aBytes) / lElapsed.count()};
+        mAcceptanceRate =
+            (mAcceptanceRate > 0) ? (mAcceptanceRate + cAcceptanceRateWeight * (lRate - mAcceptanceRate)) : lRate;
+    }
+
+    if (mEnabled) {
+        if (aTimedOut) {
+            // Back off to below what the PSP managed lately
+            double lRate{mBucket.IsUnlimited() ? mAcceptanceRate : std::min(mBucket.GetRate(), mAcceptanceRate)};
+            lRate = std::max(cMinimumRate, lRate * cRateDecrease);
+            mBucket.SetRate(lRate);
+            Logger::GetInstance().Log("PSP cannot keep up, pacing to " + std::to_string(static_cast<int>(lRate)) +
+                                          " bytes/s",
+                                      Logger::Level::DEBUG);
+        } else if (!mBucket.IsUnlimited()) {
+            double lRate{mBucket.GetRate() + cRateIncrease};
+            if (lRate >= cMaximumRate) {
+                lRate = 0;
+                Logger::GetInstance().Log("PSP keeps up again, stopped pacing", Logger::Level::DEBUG);
+            }
+            mBucket.SetRate(lRate);
+        }
+    }
+}
+
+double USBPacer::GetAcceptanceRate() const
+{
+    return mAcceptanceRate;
+}
+
+double USBPacer::GetRate() const
+{
+    return mBucket.GetRate();
+}
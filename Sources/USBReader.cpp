@@ -2,6 +2,7 @@
 
 /* Copyright (c) 2021 [Rick de Bondt] - USBReader.cpp */
 
+#include <algorithm>
 #include <array>
 #include <chrono>
 #include <cstdio>
@@ -29,8 +30,11 @@ extern "C" {
 
 #include <libusb.h>
 
+#include "../Includes/LocalSwitch.h"
 #include "../Includes/Logger.h"
 #include "../Includes/NetConversionFunctions.h"
+#include "../Includes/PacketFilter.h"
+#include "../Includes/USBPacketViews.h"
 #include "../Includes/USBReceiveThread.h"
 #include "../Includes/USBSendThread.h"
 #include "../Includes/XLinkKaiConnection.h"
@@ -55,28 +59,35 @@ USBReader::USBReader(
     mWriteTimeoutMS(aWriteTimeoutMS)
 {
     libusb_init(nullptr);
+
+    mHostFSServer.SetTransport(
+        [this](char* aData, int aSize) {
+            return USBBulkRead(cUSBDataReadEndpoint, aData, aSize, cMaxUSBHostFSTimeout);
+        },
+        [this](char* aData, int aSize) {
+            return USBBulkWrite(cUSBHostFSWriteEndpoint, aData, aSize, cMaxUSBHostFSTimeout);
+        },
+        [this] {
+            if (!mReassembler.IsInProgress()) {
+                HandleAsynchronousSend();
+            }
+        });
 }
 
 /**
  * Checks if command is a debugprint command with the given mode.
- * @param aData - Data to check.
- * @param aLength - Length of data to check.
+ * @param aSubHeader - Subheader of the command to check.
  * @return number of debugprint command if it is a debugprint command
  */
-static inline int IsDebugPrintCommand(AsyncCommand& aData, int aLength)
+static inline int IsDebugPrintCommand(const AsyncSubHeaderView& aSubHeader)
 {
     int lReturn{0};
-    int lLength{aLength};
     // Check if it has a subheader
-    if (lLength > cAsyncHeaderAndSubHeaderSize) {
-        Logger::GetInstance().Log("Size of packet:" + std::to_string(aLength), Logger::Level::TRACE);
-        lLength -= cAsyncHeaderSize;
-        auto* lSubHeader{reinterpret_cast<AsyncSubHeader*>(reinterpret_cast<char*>(&aData) + cAsyncHeaderSize)};
-        if (lSubHeader->magic == DebugPrint) {
-            if (lSubHeader->mode == cAsyncModePacket && lSubHeader->ref == cAsyncCommandSendPacket) {
-                Logger::GetInstance().Log("Size reported: " + std::to_string(lSubHeader->size), Logger::Level::TRACE);
+    if (aSubHeader.IsValid() && !aSubHeader.Payload().empty()) {
+        if (aSubHeader.Magic() == DebugPrint) {
+            if (aSubHeader.Mode() == cAsyncModePacket && aSubHeader.Ref() == cAsyncCommandSendPacket) {
                 lReturn = cAsyncModePacket;
-            } else if (lSubHeader->mode == cAsyncModeDebug) {
+            } else if (aSubHeader.Mode() == cAsyncModeDebug) {
                 lReturn = cAsyncModeDebug;
             }
         }
@@ -90,108 +101,231 @@ void USBReader::Close()
     mStopRequest = true;
 
     if (mUSBThread != nullptr) {
-        while (mStopRequest && !mUSBThread->joinable()) {
-            std::this_thread::sleep_for(1s);
+        // Reads time out within mReadTimeoutMS, so the thread notices right away
+        if (mUSBThread->joinable()) {
+            mUSBThread->join();
         }
-        mUSBThread->join();
         mUSBThread = nullptr;
     } else {
         HandleClose();
     }
 
-    if (mUSBSendThread != nullptr) {
-        mUSBSendThread->StopThread();
-        mUSBSendThread = nullptr;
-    }
-    if (mUSBReceiveThread != nullptr) {
-        mUSBReceiveThread->StopThread();
-        mUSBReceiveThread = nullptr;
+    // Only the first close after a start has anything to stop and report, so closing twice is harmless
+    if (mUSBSendThread != nullptr || mUSBReceiveThread != nullptr) {
+        if (mUSBReceiveThread != nullptr) {
+            mUSBReceiveThread->StopThread();
+            mUSBReceiveThread = nullptr;
+        }
+
+        std::shared_ptr<USBSendThread> lUSBSendThread{nullptr};
+        {
+            // XLink Kai and other PSPs may be in Send() right now
+            std::lock_guard<std::mutex> lLock{mSendMutex};
+            lUSBSendThread.swap(mUSBSendThread);
+        }
+        if (lUSBSendThread != nullptr) {
+            mAggregatedFrames = lUSBSendThread->GetAggregatedFrameCount();
+            lUSBSendThread->ClearQueues();
+        }
+
+        LogStatistics();
     }
 }
 
-void USBReader::HandleAsynchronous(AsyncCommand& aData, int aLength)
-{
-    if (aData.channel == cAsyncUserChannel) {
-        BinaryStitchUSBPacket lPacket{};
-        if (!mReceiveStitching) {
-            int lPacketMode{IsDebugPrintCommand(aData, aLength)};
-
-            if (lPacketMode > 0) {
-                // We know it's a DebugPrint command, so we can skip past this header as well now
-                unsigned int lLength = aLength - cAsyncHeaderAndSubHeaderSize;
-                int          lActualPacketLength{0};
-                // We are a packet, so we can check if we can send it off
-                switch (lPacketMode) {
-                    case cAsyncModePacket:
-                        // Grab the packet length from the packet
-                        lActualPacketLength =
-                            reinterpret_cast<AsyncSubHeader*>(reinterpret_cast<char*>(&aData) + cAsyncHeaderSize)->size;
-
-                        lPacket.stitch    = lActualPacketLength > (cMaxUSBPacketSize - cAsyncHeaderAndSubHeaderSize);
-                        mActualLength     = lActualPacketLength;
-                        mReceiveStitching = lPacket.stitch;
-
-                        // Skip headers already
-                        lPacket.length = aLength - cAsyncHeaderAndSubHeaderSize;
-                        if (lPacket.stitch) {
-                            mStitchingLength = lPacket.length;
-                        }
+void USBReader::LogStatistics() const
+{
+    if (mAggregatedFrames > 0 || mFramesUnpacked > 0) {
+        Logger::GetInstance().Log("Frames packed together: " + std::to_string(mAggregatedFrames) + " to PSP, " +
+                                      std::to_string(mFramesUnpacked) + " from PSP",
+                                  Logger::Level::INFO);
+    }
 
-                        memcpy(lPacket.data.data(),
-                               reinterpret_cast<char*>(&aData) + cAsyncHeaderAndSubHeaderSize,
-                               lPacket.length);
-
-                        mUSBReceiveThread->AddToQueue(lPacket);
-                        break;
-                    case cAsyncModeDebug:
-                        // We can just go ahead and print the debug data, I'm assuming it will never go past 512 bytes.
-                        // If it does, we'll see when we get there :|
-                        Logger::GetInstance().Log(
-                            "PSP: " +
-                                std::string(reinterpret_cast<char*>(&aData) + cAsyncHeaderAndSubHeaderSize, lLength),
-                            Logger::Level::INFO);
-                        break;
-                    default:
-                        // Don't know what we got
-                        Logger::GetInstance().Log(
-                            "Unknown data:" + PrettyHexString(std::string(reinterpret_cast<char*>(&aData), mLength)),
-                            Logger::Level::DEBUG);
-                }
-            } else {
-                // Don't know what we got
-                Logger::GetInstance().Log(
-                    "Unknown data:" + PrettyHexString(std::string(reinterpret_cast<char*>(&aData), mLength)),
-                    Logger::Level::DEBUG);
-            }
-        } else {
-            Logger::GetInstance().Log("RecStitch: Old: " + std::to_string(mStitchingLength) +
-                                          " , Add: " + std::to_string(aLength - cAsyncHeaderSize) +
-                                          " of: " + std::to_string(mActualLength),
-                                      Logger::Level::TRACE);
+    uint64_t lFramesTotal{mFramesSent + mFramesDropped};
+    if (lFramesTotal > 0) {
+        Logger::GetInstance().Log("Frames to PSP: " + std::to_string(mFramesSent) + " sent, " +
+                                      std::to_string(mFramesResumed) + " resumed, " + std::to_string(mFramesDropped) +
+                                      " dropped, loss rate: " +
+                                      std::to_string(100.0 * static_cast<double>(mFramesDropped) /
+                                                     static_cast<double>(lFramesTotal)) +
+                                      "%",
+                                  Logger::Level::INFO);
+    }
+
+    if (mMacFilter.GetFilteredCount() > 0) {
+        Logger::GetInstance().Log("Frames for other PSPs filtered: " + std::to_string(mMacFilter.GetFilteredCount()) +
+                                      " of " +
+                                      std::to_string(mMacFilter.GetFilteredCount() + mMacFilter.GetForwardedCount()),
+                                  Logger::Level::INFO);
+    }
+
+    if (mStormFilter.GetRateLimitedCount() > 0 || mStormFilter.GetDuplicateCount() > 0) {
+        Logger::GetInstance().Log("Frames suppressed: " + std::to_string(mStormFilter.GetRateLimitedCount()) +
+                                      " broadcasts over the limit, " +
+                                      std::to_string(mStormFilter.GetDuplicateCount()) + " duplicates",
+                                  Logger::Level::INFO);
+    }
+
+    if (mPacer.GetAcceptanceRate() > 0) {
+        Logger::GetInstance().Log("PSP acceptance rate: " +
+                                      std::to_string(static_cast<int>(mPacer.GetAcceptanceRate())) + " bytes/s",
+                                  Logger::Level::INFO);
+    }
+
+    if (mChunksDroppedUpstreamDown > 0) {
+        Logger::GetInstance().Log("Chunks from PSP dropped while XLink Kai was not connected: " +
+                                      std::to_string(mChunksDroppedUpstreamDown),
+                                  Logger::Level::INFO);
+    }
 
-            mStitchingLength += aLength - cAsyncHeaderSize;
-            lPacket.stitch = (aLength > (cMaxUSBPacketSize - cAsyncHeaderSize)) && (mStitchingLength < mActualLength);
-            mReceiveStitching = lPacket.stitch;
-            if (!lPacket.stitch) {
-                mStitchingLength = 0;
+    mHostFSServer.LogStatistics();
+
+    if (mDemultiplexer.GetUnhandledCount() > 0) {
+        Logger::GetInstance().Log("Asynchronous chunks on unhandled channels: " +
+                                      std::to_string(mDemultiplexer.GetUnhandledCount()),
+                                  Logger::Level::INFO);
+    }
+
+    if (mReassembler.GetResyncCount() > 0) {
+        Logger::GetInstance().Log("Frames from PSP: " + std::to_string(mReassembler.GetResyncCount()) +
+                                      " resyncs, " + std::to_string(mReassembler.GetDiscardedBytes()) +
+                                      " bytes discarded",
+                                  Logger::Level::INFO);
+    }
+}
+
+void USBReader::HandleAsynchronous(const AsyncCommandView& aData)
+{
+    if (aData.Channel() == cAsyncUserChannel) {
+        AsyncSubHeaderView lSubHeader{aData.Payload()};
+        if (IsDebugPrintCommand(lSubHeader) == cAsyncModeDebug) {
+            // I'm assuming it will never go past 512 bytes. If it does, we'll see when we get there :|
+            mDemultiplexer.PostDebugPrint(lSubHeader.Payload());
+        } else if (!mUpstreamAvailable) {
+            // Nothing would take the frame, so don't bother putting it together
+            mReassembler.Reset();
+            mChunksDroppedUpstreamDown++;
+        } else if (mAggregation && lSubHeader.IsValid() && lSubHeader.Magic() == DebugPrint &&
+                   lSubHeader.Mode() == cAsyncModePacket && lSubHeader.Ref() == cAsyncCommandSendAggregate) {
+            // A continuation got lost if a packet is still halfway, it must not get the packed frames glued onto it
+            mReassembler.Interrupt("Packed frames arrived before the previous packet finished");
+            HandleAggregate(lSubHeader);
+        } else {
+            std::string_view lPacket{mReassembler.AddChunk(aData.Payload())};
+            if (!lPacket.empty()) {
+                ForwardFromPSP(lPacket);
             }
+        }
+    } else {
+        mDemultiplexer.Dispatch(aData);
+    }
+}
+
+void USBReader::ForwardFromPSP(std::string_view aPacket)
+{
+    mMacFilter.Learn(aPacket);
+    mFlowsFromPSP.Update(aPacket);
+    mUSBReceiveThread->AddToQueue(aPacket);
+}
+
+void USBReader::HandleAggregate(const AsyncSubHeaderView& aSubHeader)
+{
+    std::string_view lRecords{aSubHeader.Payload().substr(0, static_cast<std::size_t>(std::max(0, aSubHeader.Size())))};
 
-            // Skip headers already
-            lPacket.length = aLength - cAsyncHeaderSize;
-            memcpy(lPacket.data.data(), reinterpret_cast<char*>(&aData) + cAsyncHeaderSize, lPacket.length);
+    while (lRecords.size() >= cAggregateLengthSize) {
+        std::size_t lLength{LoadUnaligned<uint16_t>(lRecords.data())};
+        lRecords.remove_prefix(cAggregateLengthSize);
 
-            mUSBReceiveThread->AddToQueue(lPacket);
+        if (lLength > 0 && lLength <= lRecords.size()) {
+            ForwardFromPSP(lRecords.substr(0, lLength));
+            lRecords.remove_prefix(lLength);
+            mFramesUnpacked++;
+        } else {
+            Logger::GetInstance().Log("Bad length in packed frames from PSP: " + std::to_string(lLength),
+                                      Logger::Level::DEBUG);
+            lRecords = {};
         }
     }
 }
 
+void USBReader::CheckUpstream()
+{
+    uint64_t lGeneration{mIncomingConnection->GetConnection().GetSessionGeneration()};
+    if (lGeneration != mUpstreamGeneration) {
+        // Whatever is queued by now may already belong to the new session, only the half frame has to go
+        mUpstreamGeneration = lGeneration;
+        mReassembler.Reset();
+    }
+
+    bool lAvailable{mIncomingConnection->IsForwarding()};
+    if (mUpstreamAvailable && !lAvailable) {
+        // Everything still queued belongs to the session that just went away
+        mUSBSendThread->ClearQueues();
+        mUSBReceiveThread->ClearQueues();
+        Logger::GetInstance().Log("XLink Kai went away, flushed queued frames", Logger::Level::DEBUG);
+    }
+    mUpstreamAvailable = lAvailable;
+}
+
 void USBReader::HandleAsynchronousSend()
 {
     while ((!mStopRequest) && mUSBSendThread->HasOutgoingData()) {
-        BinaryStitchUSBPacket lFormattedPacket = mUSBSendThread->PopFromOutgoingQueue();
-        mSendStitching                         = lFormattedPacket.stitch;
-        if (USBBulkWrite(
-                cUSBDataWriteEndpoint, lFormattedPacket.data.data(), lFormattedPacket.length, mWriteTimeoutMS) == -1) {
+        USBFrame& lFrame{mUSBSendThread->FrontOfOutgoingQueue()};
+        if (!mPacer.CanSend(lFrame.length)) {
+            // Leave it in the queue, next round
+            break;
+        }
+
+        WriteFrame(lFrame);
+        mUSBSendThread->PopFromOutgoingQueue();
+    }
+}
+
+bool USBReader::SendAbortMarker()
+{
+    std::array<char, cAsyncHeaderAndSubHeaderSize> lMarker{};
+    memcpy(lMarker.data(), cAsyncUserHeaderTemplate.data(), cAsyncHeaderSize);
+    memcpy(lMarker.data() + cAsyncHeaderSize, cAbortSubHeaderTemplate.data(), cAsyncSubHeaderSize);
+
+    return USBBulkWrite(cUSBDataWriteEndpoint, lMarker.data(), static_cast<int>(lMarker.size()), mWriteTimeoutMS) ==
+           static_cast<int>(lMarker.size());
+}
+
+bool USBReader::WriteFrame(USBFrame& aFrame)
+{
+    int  lOffset{0};
+    int  lFailedAttempts{0};
+    bool lResumed{false};
+
+    // The chunks are laid out one USB packet apart, so the whole frame goes out as one transfer and gets split
+    // into USB packets on the same chunk boundaries by libusb. When a write times out halfway the PSP has the first
+    // part already, so carry on from there instead of starting over or skipping to the next frame.
+    while (lOffset < aFrame.length && !mStopRequest && !mError) {
+        // Once the PSP has part of the frame, finishing it is the only way to stay in sync unless it can be told to
+        // throw it away, so it gets the whole retry budget instead of being dropped after a few attempts.
+        int lMaxAttempts{(lOffset > 0 && !mAbortMarker) ? mMaxReadWriteRetries : cMaxFrameWriteRetries};
+        if (lFailedAttempts >= lMaxAttempts) {
+            break;
+        }
+
+        int lRemaining{aFrame.length - lOffset};
+
+        std::chrono::steady_clock::time_point lStart{std::chrono::steady_clock::now()};
+        int lLength{USBBulkWrite(cUSBDataWriteEndpoint, aFrame.data.data() + lOffset, lRemaining, mWriteTimeoutMS)};
+
+        // Only a timeout means the PSP can't keep up, anything else is no reason to slow down
+        bool lTimedOut{lLength == LIBUSB_ERROR_TIMEOUT || (lLength >= 0 && lLength < lRemaining)};
+        if (lLength >= 0 || lTimedOut) {
+            mPacer.OnWriteComplete(std::max(lLength, 0), std::chrono::steady_clock::now() - lStart, lTimedOut);
+        }
+
+        if (lLength > 0) {
+            lOffset += lLength;
+            lResumed = lResumed || (lOffset < aFrame.length);
+        } else if (lLength != LIBUSB_ERROR_TIMEOUT) {
+            // Pipe stalled, device gone or the like, waiting won't fix that
+            mError = true;
+        } else {
+            lFailedAttempts++;
             std::this_thread::sleep_for(std::chrono::milliseconds(mWriteTimeoutMS));
             mReadWriteRetryCounter++;
             if (mReadWriteRetryCounter > mMaxReadWriteRetries) {
@@ -199,18 +333,48 @@ void USBReader::HandleAsynchronousSend()
             }
         }
     }
+
+    bool lReturn{lOffset >= aFrame.length};
+    if (lReturn) {
+        mFramesSent++;
+        if (lResumed) {
+            mFramesResumed++;
+        }
+    } else {
+        mFramesDropped++;
+        Logger::GetInstance().Log("Dropped frame for the PSP after " + std::to_string(lOffset) + " of " +
+                                      std::to_string(aFrame.length) + " bytes",
+                                  Logger::Level::DEBUG);
+
+        if (lOffset > 0 && !mStopRequest && !mError) {
+            // The PSP is halfway this frame. Without a marker it would take the next frame as the rest of this one,
+            // so it either gets told to throw it away or, with the retry budget spent, the link gets reset.
+            if (!mAbortMarker || (lOffset % static_cast<int>(cMaxUSBPacketSize)) != 0 || !SendAbortMarker()) {
+                Logger::GetInstance().Log("Out of sync with the PSP after dropping a frame, resetting",
+                                          Logger::Level::WARNING);
+                mError = true;
+            }
+        }
+    }
+
+    return lReturn;
 }
 
 void USBReader::HandleClose()
 {
     if (mDeviceHandle != nullptr) {
+        // Device memory goes away with the device, so release it first
+        if (mUSBSendThread != nullptr) {
+            mUSBSendThread->UseDeviceMemory(nullptr);
+        }
+        mReceiveBuffer.Free();
+
         libusb_reset_device(mDeviceHandle);
         libusb_release_interface(mDeviceHandle, 0);
         libusb_attach_kernel_driver(mDeviceHandle, 0);
         libusb_close(mDeviceHandle);
         mDeviceHandle = nullptr;
     }
-    mStopRequest = false;
 }
 
 void USBReader::HandleError()
@@ -223,11 +387,19 @@ void USBReader::HandleError()
     mError              = false;
     mUSBCheckSuccessful = false;
 
-    mReceiveStitching = false;
-    mSendStitching    = false;
+    mReassembler.Reset();
+    // Might be a different PSP after the reset
+    mMacFilter.Clear();
+    mHostFSServer.Reset();
+    // Back to the plain format until the PSP says hello again
+    mAggregation = false;
+    mAbortMarker = false;
+    mUSBSendThread->SetAggregation(false);
 
     mUSBSendThread->ClearQueues();
     mUSBReceiveThread->ClearQueues();
+    // Just flushed everything, no need to do it again for the current XLink Kai session
+    mUpstreamGeneration = mIncomingConnection->GetConnection().GetSessionGeneration();
 
     Logger::GetInstance().Log("Ran into a snag, restarting stack!", Logger::Level::DEBUG);
     std::this_thread::sleep_for(1ms);
@@ -252,7 +424,6 @@ bool USBReader::Open()
             if (lReturn >= 0) {
                 if ((lDescriptor.idVendor == cPSPVID) && (lDescriptor.idProduct == cPSPPID)) {
                     lReturn = libusb_open(lDevice, &lDeviceHandle);
-                    libusb_free_device_list(lDevices, 1);
                     if (lReturn >= 0 && lDeviceHandle != nullptr) {
                         libusb_set_auto_detach_kernel_driver(lDeviceHandle, 1);
                         lReturn = libusb_set_configuration(lDeviceHandle, 1);
@@ -261,12 +432,23 @@ bool USBReader::Open()
                             lReturn = libusb_claim_interface(lDeviceHandle, 0);
                             if (lReturn == 0) {
                                 mDeviceHandle = lDeviceHandle;
+                                mReceiveBuffer.Allocate(mDeviceHandle, cMaxUSBReadBufferSize);
+                                if (mUSBSendThread != nullptr) {
+                                    mUSBSendThread->UseDeviceMemory(mDeviceHandle);
+                                }
+                            } else if (lReturn == LIBUSB_ERROR_BUSY) {
+                                Logger::GetInstance().Log("PSP already in use, skipping", Logger::Level::DEBUG);
+                                libusb_close(lDeviceHandle);
                             } else {
                                 Logger::GetInstance().Log(std::string("Could not detach kernel driver: ") +
                                                               libusb_strerror(static_cast<libusb_error>(lReturn)),
                                                           Logger::Level::ERROR);
                                 libusb_close(lDeviceHandle);
                             }
+                        } else if (lReturn == LIBUSB_ERROR_BUSY) {
+                            // Another one of us already has this PSP, look further
+                            Logger::GetInstance().Log("PSP already in use, skipping", Logger::Level::DEBUG);
+                            libusb_close(lDeviceHandle);
                         } else {
                             Logger::GetInstance().Log(std::string("Could set configuration: ") +
                                                           libusb_strerror(static_cast<libusb_error>(lReturn)),
@@ -289,9 +471,10 @@ bool USBReader::Open()
                 Logger::GetInstance().Log(std::string("Cannot query device descriptor: ") +
                                               libusb_strerror(static_cast<libusb_error>(lReturn)),
                                           Logger::Level::ERROR);
-                libusb_free_device_list(lDevices, 1);
             }
         }
+        // Only free the list when done with it, the opened device holds its own reference
+        libusb_free_device_list(lDevices, 1);
     } else {
         Logger::GetInstance().Log(
             std::string("Could not get device list: ") + libusb_strerror(static_cast<libusb_error>(lReturn)),
@@ -301,23 +484,85 @@ bool USBReader::Open()
     return (mDeviceHandle != nullptr);
 }
 
-void USBReader::SetIncomingConnection(std::shared_ptr<XLinkKaiConnection> aDevice)
+void USBReader::SetPacing(bool aEnabled)
+{
+    mPacer.SetEnabled(aEnabled);
+}
+
+void USBReader::SetSendScheduler(USBSendThread_Constants::Scheduler aScheduler, int aSmallFrameThreshold)
+{
+    mSendScheduler       = aScheduler;
+    mSmallFrameThreshold = aSmallFrameThreshold;
+}
+
+void USBReader::SetMacFiltering(bool aEnabled)
+{
+    mMacFiltering = aEnabled;
+}
+
+void USBReader::SetStormSuppression(int aBroadcastRate, int aDuplicateWindowMS)
+{
+    mStormFilter.SetThresholds(aBroadcastRate, aDuplicateWindowMS);
+}
+
+void USBReader::SetAggregation(bool aAllowed)
+{
+    mAggregationAllowed = aAllowed;
+}
+
+void USBReader::SetHostFSRoot(const std::string& aRoot)
+{
+    if (!aRoot.empty()) {
+        mHostFSServer.SetRoot(aRoot);
+    }
+}
+
+void USBReader::SetPacketFilters(std::shared_ptr<PacketFilter> aToPSP, std::shared_ptr<PacketFilter> aFromPSP)
+{
+    mFilterToPSP   = std::move(aToPSP);
+    mFilterFromPSP = std::move(aFromPSP);
+}
+
+AsyncDemultiplexer& USBReader::GetDemultiplexer()
+{
+    return mDemultiplexer;
+}
+
+void USBReader::LogFlows() const
+{
+    Logger::GetInstance().Log(mFlowsFromPSP.ToString("Flows from PSP"), Logger::Level::INFO);
+    Logger::GetInstance().Log(mFlowsToPSP.ToString("Flows to PSP"), Logger::Level::INFO);
+}
+
+uint64_t USBReader::GetFilteredFrameCount() const
+{
+    return mMacFilter.GetFilteredCount();
+}
+
+void USBReader::SetIncomingConnection(std::shared_ptr<LocalSwitch> aDevice)
 {
     mIncomingConnection = aDevice;
 }
 
 int USBReader::USBBulkRead(int aEndpoint, int aSize, int aTimeOut)
+{
+    int lReturn{-1};
+    if (aSize <= static_cast<int>(mReceiveBuffer.Size())) {
+        lReturn = USBBulkRead(aEndpoint, mReceiveBuffer.Data(), aSize, aTimeOut);
+    }
+
+    return lReturn;
+}
+
+int USBReader::USBBulkRead(int aEndpoint, char* aData, int aSize, int aTimeOut)
 {
     int lReturn{-1};
     int lError{0};
-    if (mDeviceHandle != nullptr) {
-        lError = libusb_bulk_transfer(mDeviceHandle,
-                                      aEndpoint,
-                                      reinterpret_cast<unsigned char*>(mTemporaryReceiveBuffer.data()),
-                                      aSize,
-                                      &lReturn,
-                                      aTimeOut);
-        if (lError != 0) {
+    if (mDeviceHandle != nullptr && aData != nullptr) {
+        lError = libusb_bulk_transfer(
+            mDeviceHandle, aEndpoint, reinterpret_cast<unsigned char*>(aData), aSize, &lReturn, aTimeOut);
+        // A timeout can still have transferred data, only an error if it did not
+        if (lError != 0 && !(lError == LIBUSB_ERROR_TIMEOUT && lReturn > 0)) {
             lReturn = lError;
         }
     } else {
@@ -334,11 +579,16 @@ int USBReader::USBBulkWrite(int aEndpoint, char* aData, int aSize, int aTimeOut)
     if (mDeviceHandle != nullptr) {
         int lError = libusb_bulk_transfer(
             mDeviceHandle, aEndpoint, reinterpret_cast<unsigned char*>(aData), aSize, &lReturn, aTimeOut);
-        if (lError < 0) {
+        // A timeout can still have transferred part of the data, the caller can carry on from there
+        if (lError == LIBUSB_ERROR_TIMEOUT && lReturn > 0) {
+            Logger::GetInstance().Log("Bulk write timed out after " + std::to_string(lReturn) + " of " +
+                                          std::to_string(aSize) + " bytes",
+                                      Logger::Level::TRACE);
+        } else if (lError < 0) {
             Logger::GetInstance().Log(
                 std::string("Error during Bulk write: ") + libusb_strerror(static_cast<libusb_error>(lError)),
                 Logger::Level::ERROR);
-            lReturn = -1;
+            lReturn = lError;
         }
     } else {
         lReturn = -1;
@@ -365,53 +615,82 @@ bool USBReader::USBCheckDevice()
     return lReturn;
 }
 
-void USBReader::ReceiveCallback()
+void USBReader::ReceiveCallback(std::string_view aData)
 {
-    int lLength{mLength};
+    std::string_view  lData{aData};
+    HostFsCommandView lCommand{lData};
 
     // Length should be atleast the size of a command header
-    if (lLength >= cHostFSHeaderSize) {
-        auto* lCommand{reinterpret_cast<HostFsCommand*>(mTemporaryReceiveBuffer.data())};
-        switch (static_cast<eMagicType>(lCommand->magic)) {
+    if (lCommand.IsValid()) {
+        switch (static_cast<eMagicType>(lCommand.Magic())) {
             case HostFS:
-                if (lCommand->command == (Hello)) {
-                    SendHello();
+                if (lCommand.Command() == (Hello)) {
+                    SendHello(lData);
+                    std::this_thread::sleep_for(100ms);
+                } else if (mHostFSServer.IsEnabled()) {
+                    if (!mHostFSServer.HandleCommand(lData)) {
+                        mError = true;
+                    }
                 } else {
                     mError = true;
                     Logger::GetInstance().Log("PSP is being rude and not sending a Hello back :V. Disconnecting!" +
-                                                  std::to_string(lCommand->command),
+                                                  std::to_string(lCommand.Command()),
                                               Logger::Level::ERROR);
                 }
-                std::this_thread::sleep_for(100ms);
                 break;
             case Asynchronous:
                 // We know it's asynchronous data now
-                HandleAsynchronous(*reinterpret_cast<AsyncCommand*>(lCommand), lLength);
+                HandleAsynchronous(AsyncCommandView(lData));
                 break;
             case Bulk:
                 Logger::GetInstance().Log("Bulk received, weird", Logger::Level::DEBUG);
             default:
-                Logger::GetInstance().Log("Magic not recognized: " + std::to_string(lCommand->magic),
+                Logger::GetInstance().Log("Magic not recognized: " + std::to_string(lCommand.Magic()),
                                           Logger::Level::DEBUG);
                 break;
         }
     } else {
         Logger::GetInstance().Log("Packet too short to be usable", Logger::Level::DEBUG);
     }
-    mLength = 0;
 }
 
-int USBReader::SendHello()
+int USBReader::SendHello(std::string_view aHello)
 {
-    HostFsCommand lResponse{};
-    memset(&lResponse, 0, cHostFSHeaderSize);
+    HostFsHelloCapabilities lResponse{};
+    memset(&lResponse, 0, sizeof(lResponse));
+
+    lResponse.cmd.magic   = HostFS;
+    lResponse.cmd.command = Hello;
+
+    // Plugins that know about capabilities append theirs to the hello, older ones get the hello they expect
+    std::size_t lResponseSize{cHostFSHeaderSize};
+    mAggregation = false;
+    mAbortMarker = false;
+    if (aHello.size() >= sizeof(HostFsHelloCapabilities) &&
+        HostFsCommandView(aHello).ExtraLength() == sizeof(lResponse.capabilities)) {
+        uint32_t lCapabilities{LoadUnaligned<uint32_t>(aHello.data() + cHostFSHeaderSize)};
+        uint32_t lOffered{mAggregationAllowed ? cSupportedCapabilities
+                                              : (cSupportedCapabilities & ~cCapabilityAggregation)};
+        lResponse.cmd.extralen = sizeof(lResponse.capabilities);
+        lResponse.capabilities = lCapabilities & lOffered;
+        lResponseSize = sizeof(lResponse);
+        mAggregation  = (lResponse.capabilities & cCapabilityAggregation) != 0;
+        mAbortMarker  = (lResponse.capabilities & cCapabilityAbortMarker) != 0;
+
+        Logger::GetInstance().Log("PSP capabilities: " + std::to_string(lCapabilities) +
+                                      ", using: " + std::to_string(lResponse.capabilities),
+                                  Logger::Level::INFO);
+    }
 
-    lResponse.magic   = HostFS;
-    lResponse.command = Hello;
-    Logger::GetInstance().Log(PrettyHexString(std::string(reinterpret_cast<char*>(&lResponse), 12)),
+    if (mUSBSendThread != nullptr) {
+        mUSBSendThread->SetAggregation(mAggregation);
+    }
+
+    Logger::GetInstance().Log(PrettyHexString(std::string(reinterpret_cast<char*>(&lResponse), lResponseSize)),
                               Logger::Level::TRACE);
 
-    return USBBulkWrite(cUSBHelloEndpoint, reinterpret_cast<char*>(&lResponse), cHostFSHeaderSize, cMaxUSBHelloTimeout);
+    return USBBulkWrite(
+        cUSBHelloEndpoint, reinterpret_cast<char*>(&lResponse), static_cast<int>(lResponseSize), cMaxUSBHelloTimeout);
 }
 
 bool USBReader::StartReceiverThread()
@@ -419,11 +698,21 @@ bool USBReader::StartReceiverThread()
     bool lReturn{true};
 
     if (mDeviceHandle != nullptr && mUSBThread == nullptr) {
-        mUSBReceiveThread = std::make_shared<USBReceiveThread>(*mIncomingConnection, mMaxBufferedMessages);
+        mStopRequest = false;
+        // Only a session that starts after this one gets its queues flushed
+        mUpstreamGeneration = mIncomingConnection->GetConnection().GetSessionGeneration();
+
+        mUSBReceiveThread = std::make_shared<USBReceiveThread>(
+            *mIncomingConnection, *this, mMaxBufferedMessages, mFilterFromPSP);
         mUSBReceiveThread->StartThread();
 
-        mUSBSendThread = std::make_shared<USBSendThread>(mMaxBufferedMessages);
-        mUSBSendThread->StartThread();
+        std::shared_ptr<USBSendThread> lUSBSendThread{std::make_shared<USBSendThread>(mMaxBufferedMessages)};
+        lUSBSendThread->SetScheduler(mSendScheduler, mSmallFrameThreshold);
+        lUSBSendThread->UseDeviceMemory(mDeviceHandle);
+        {
+            std::lock_guard<std::mutex> lLock{mSendMutex};
+            mUSBSendThread = lUSBSendThread;
+        }
 
         mUSBThread = std::make_shared<std::thread>([&] {
             // If we didn't get a graceful disconnect retry making connection.
@@ -443,28 +732,32 @@ bool USBReader::StartReceiverThread()
                         mRetryCounter = 0;
                     }
 
-                    if (!mSendStitching) {
-                        // First read, then write
-                        int lLength{USBBulkRead(cUSBDataReadEndpoint, cMaxUSBPacketSize, mReadTimeoutMS)};
-                        if (lLength > 0) {
-                            mLength       = lLength;
-                            mRetryCounter = 0;
-                            ReceiveCallback();
-                        } else if (lLength == LIBUSB_ERROR_TIMEOUT || lLength == LIBUSB_ERROR_BUSY) {
-                            std::this_thread::sleep_for(std::chrono::milliseconds(mReadTimeoutMS));
-                        } else if (mDeviceHandle == nullptr) {
+                    CheckUpstream();
+
+                    // First read, then write
+                    int lLength{USBBulkRead(cUSBDataReadEndpoint, cMaxUSBReadBufferSize, mReadTimeoutMS)};
+                    if (lLength > 0) {
+                        mRetryCounter = 0;
+                        // Every chunk the PSP sent takes up a whole USB packet, except for the last one
+                        for (int lOffset = 0; lOffset < lLength; lOffset += static_cast<int>(cMaxUSBPacketSize)) {
+                            ReceiveCallback(std::string_view(
+                                mReceiveBuffer.Data() + lOffset,
+                                std::min(static_cast<int>(cMaxUSBPacketSize), lLength - lOffset)));
+                        }
+                    } else if (lLength == LIBUSB_ERROR_TIMEOUT || lLength == LIBUSB_ERROR_BUSY) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(mReadTimeoutMS));
+                    } else if (mDeviceHandle == nullptr) {
+                        mError = true;
+                    } else {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(mReadTimeoutMS));
+                        mReadWriteRetryCounter++;
+                        if (mReadWriteRetryCounter > mMaxReadWriteRetries) {
                             mError = true;
-                        } else {
-                            std::this_thread::sleep_for(std::chrono::milliseconds(mReadTimeoutMS));
-                            mReadWriteRetryCounter++;
-                            if (mReadWriteRetryCounter > mMaxReadWriteRetries) {
-                                mError = true;
-                            }
-                            // Probably fatal, try a restart of the device
                         }
+                        // Probably fatal, try a restart of the device
                     }
 
-                    if (!mReceiveStitching) {
+                    if (!mReassembler.IsInProgress()) {
                         HandleAsynchronousSend();
                     }
                 }
@@ -478,8 +771,15 @@ bool USBReader::StartReceiverThread()
 
 void USBReader::Send(std::string_view aData)
 {
-    // Handle in send thread
-    mUSBSendThread->AddToQueue(aData);
+    // Gets formatted for the PSP right away, the USB thread sends it off
+    if ((!mMacFiltering || mMacFilter.ShouldForward(aData)) &&
+        (mFilterToPSP == nullptr || mFilterToPSP->ShouldForward(aData))) {
+        std::lock_guard<std::mutex> lLock{mSendMutex};
+        if (mUSBSendThread != nullptr && mStormFilter.ShouldForward(aData)) {
+            mFlowsToPSP.Update(aData);
+            mUSBSendThread->AddToQueue(aData);
+        }
+    }
 }
 
 USBReader::~USBReader()
@@ -0,0 +1,113 @@
+#include "../Includes/USBReassembler.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - USBReassembler.cpp */
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "../Includes/Logger.h"
+#include "../Includes/USBPacketViews.h"
+
+using namespace USB_Constants;
+
+/**
+ * Checks if the chunk is the first chunk of a packet.
+ * @param aSubHeader - Subheader of the chunk.
+ * @return true if it is.
+ */
+static inline bool IsFirstChunk(const AsyncSubHeaderView& aSubHeader)
+{
+    return aSubHeader.IsValid() && aSubHeader.Magic() == DebugPrint && aSubHeader.Mode() == cAsyncModePacket &&
+           aSubHeader.Ref() == cAsyncCommandSendPacket;
+}
+
+std::string_view USBReassembler::AddChunk(std::string_view aPayload)
+{
+    std::string_view lReturn{};
+    std::string_view lData{};
+
+    AsyncSubHeaderView lSubHeader{aPayload};
+    if (IsFirstChunk(lSubHeader)) {
+        if (mExpectedLength > 0) {
+            Resync("New packet started before the previous one finished", 0);
+        }
+
+        int32_t lSize{lSubHeader.Size()};
+        if (lSize > 0 && lSize <= static_cast<int32_t>(cMaxAsynchronousBuffer)) {
+            mExpectedLength = lSize;
+            mLength         = 0;
+            lData           = lSubHeader.Payload();
+        } else {
+            Resync("Packet size out of range: " + std::to_string(lSize), aPayload.size());
+        }
+    } else if (mExpectedLength > 0) {
+        lData = aPayload;
+    } else {
+        Resync("Chunk without a packet to belong to", aPayload.size());
+    }
+
+    if (mExpectedLength > 0) {
+        // Every chunk but the last one is filled up completely
+        std::size_t lChunkLength{std::min(mExpectedLength - mLength, lData.size())};
+        std::size_t lMaxChunkLength{cMaxUSBPacketSize - cAsyncHeaderSize - (mLength == 0 ? cAsyncSubHeaderSize : 0)};
+
+        if (lChunkLength == lMaxChunkLength || mLength + lChunkLength == mExpectedLength) {
+            memcpy(mBuffer.data() + mLength, lData.data(), lChunkLength);
+            mLength += lChunkLength;
+
+            if (mLength == mExpectedLength) {
+                lReturn         = std::string_view(mBuffer.data(), mLength);
+                mExpectedLength = 0;
+                mLength         = 0;
+            }
+        } else {
+            Resync("Chunk too short: " + std::to_string(lData.size()) + " of " + std::to_string(mExpectedLength) +
+                       " at " + std::to_string(mLength),
+                   aPayload.size());
+        }
+    }
+
+    return lReturn;
+}
+
+void USBReassembler::Resync(const std::string& aReason, std::size_t aChunkSize)
+{
+    mResyncCount++;
+    mDiscardedBytes += mLength + aChunkSize;
+
+    Logger::GetInstance().Log("Reassembly: " + aReason + ", discarding " +
+                                  std::to_string(mLength + aChunkSize) + " bytes",
+                              Logger::Level::DEBUG);
+
+    mExpectedLength = 0;
+    mLength         = 0;
+}
+
+void USBReassembler::Interrupt(const std::string& aReason)
+{
+    if (mExpectedLength > 0) {
+        Resync(aReason, 0);
+    }
+}
+
+void USBReassembler::Reset()
+{
+    mExpectedLength = 0;
+    mLength         = 0;
+}
+
+bool USBReassembler::IsInProgress() const
+{
+    return mExpectedLength > 0;
+}
+
+uint64_t USBReassembler::GetResyncCount() const
+{
+    return mResyncCount;
+}
+
+uint64_t USBReassembler::GetDiscardedBytes() const
+{
+    return mDiscardedBytes;
+}
@@ -2,64 +2,55 @@
 
 /* Copyright (c) 2021 [Rick de Bondt] - USBReceiveThread.cpp */
 
+#include <cstring>
+
 #include "../Includes/Logger.h"
-#include "../Includes/XLinkKaiConnection.h"
+#include "../Includes/LocalSwitch.h"
+#include "../Includes/PacketFilter.h"
+
+using namespace USBReceiveThread_Constants;
 
-USBReceiveThread::USBReceiveThread(XLinkKaiConnection& aConnection, int aMaxBufferSize) :
-    mConnection(aConnection), mMaxBufferSize(aMaxBufferSize)
+USBReceiveThread::USBReceiveThread(LocalSwitch&                  aConnection,
+                                   USBReader&                    aSource,
+                                   int                           aMaxBufferSize,
+                                   std::shared_ptr<PacketFilter> aFilter) :
+    mMaxBufferSize(aMaxBufferSize),
+    mConnection(aConnection), mSource(aSource), mFilter(std::move(aFilter))
 {}
 
 bool USBReceiveThread::StartThread()
 {
     bool lReturn{true};
     if (mThread == nullptr) {
-        mDone   = false;
-        lReturn = true;
-        mThread = std::make_shared<std::thread>([&] {
+        mStopRequest = false;
+        lReturn      = true;
+        mThread      = std::make_shared<std::thread>([&] {
             while (!mStopRequest) {
-                mMutex.lock();
-                if (!mQueue.empty()) {
+                std::size_t lCount{0};
+                {
+                    std::unique_lock<std::mutex> lLock{mMutex};
+                    mCondition.wait(lLock, [&] { return mStopRequest || !mQueue.empty(); });
                     // Do a deep copy so we can keep this mutex locked as short as possible
-                    USB_Constants::BinaryStitchUSBPacket lFrontOfQueue(mQueue.front());
-                    size_t                               lQueueSize{mQueue.size()};
-                    mQueue.pop();
-                    mMutex.unlock();
-
-
-                    // If the last message was too big for the USB-buffer, append the current one.
-                    if (mLastReceivedMessage.stitch) {
-                        memcpy(mLastReceivedMessage.data.data() + mLastReceivedMessage.length,
-                               lFrontOfQueue.data.data(),
-                               lFrontOfQueue.length);
-
-                        mLastReceivedMessage.length += lFrontOfQueue.length;
-                        mLastReceivedMessage.stitch = lFrontOfQueue.stitch;
-                    } else {
-                        // Replace last received since the previous one wasn't a stitch packet
-                        memcpy(mLastReceivedMessage.data.data(), lFrontOfQueue.data.data(), lFrontOfQueue.length);
-
-                        mLastReceivedMessage.length = lFrontOfQueue.length;
-                        mLastReceivedMessage.stitch = lFrontOfQueue.stitch;
+                    while (!mQueue.empty() && lCount < cMaxBatchSize) {
+                        mBatch[lCount] = mQueue.front();
+                        mQueue.pop();
+                        lCount++;
                     }
+                }
 
-                    // Check if we should continue stitching
-                    if (mLastReceivedMessage.length > USB_Constants::cMaxAsynchronousBuffer) {
-                        Logger::GetInstance().Log("Something went wrong while stitching. Dropping packet!",
-                                                  Logger::Level::ERROR);
-                        mLastReceivedMessage = {};
-                        // Check if we can send this off
-                    } else if (!lFrontOfQueue.stitch) {
-                        mConnection.Send(
-                            std::string_view(mLastReceivedMessage.data.data(), mLastReceivedMessage.length));
-                        mLastReceivedMessage = {};
-                    }
-                } else {
-                    // Never forget to unlock a mutex
-                    mMutex.unlock();
+                std::array<std::string_view, cMaxBatchSize> lFrames{};
+                for (std::size_t lIndex = 0; lIndex < lCount; lIndex++) {
+                    lFrames[lIndex] = std::string_view(mBatch[lIndex].data.data(), mBatch[lIndex].length);
+                }
+
+                if (mFilter != nullptr) {
+                    lCount = mFilter->Filter(std::span<std::string_view>(lFrames.data(), lCount));
+                }
+
+                for (std::size_t lIndex = 0; lIndex < lCount; lIndex++) {
+                    mConnection.Send(mSource, lFrames[lIndex]);
                 }
-                std::this_thread::sleep_for(std::chrono::microseconds(10));
             }
-            mDone = true;
         });
     }
     return lReturn;
@@ -67,32 +58,42 @@ bool USBReceiveThread::StartThread()
 
 void USBReceiveThread::StopThread()
 {
-    mStopRequest = true;
-    while (!mDone) {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+    {
+        std::lock_guard<std::mutex> lLock{mMutex};
+        mStopRequest = true;
     }
-    ClearQueues();
+    mCondition.notify_all();
 
     if (mThread != nullptr && mThread->joinable()) {
         mThread->join();
     }
+    ClearQueues();
     mThread = nullptr;
 }
 
-bool USBReceiveThread::AddToQueue(const USB_Constants::BinaryStitchUSBPacket& aStruct)
+bool USBReceiveThread::AddToQueue(std::string_view aData)
 {
     bool lReturn{false};
-    if (mQueue.size() < mMaxBufferSize) {
-        lReturn = true;
-        mMutex.lock();
-        mQueue.push(aStruct);
-        mMutex.unlock();
-        if (mQueue.size() > 50) {
-            Logger::GetInstance().Log("Receivebuffer got to over 50! " + std::to_string(mQueue.size()),
-                                      Logger::Level::WARNING);
+    if (aData.size() <= USB_Constants::cMaxAsynchronousBuffer) {
+        std::unique_lock<std::mutex> lLock{mMutex};
+        if (mQueue.size() < mMaxBufferSize) {
+            lReturn = true;
+            USB_Constants::BinaryWiFiPacket& lPacket{mQueue.emplace()};
+            memcpy(lPacket.data.data(), aData.data(), aData.size());
+            lPacket.length = aData.size();
+
+            if (mQueue.size() > 50) {
+                Logger::GetInstance().Log("Receivebuffer got to over 50! " + std::to_string(mQueue.size()),
+                                          Logger::Level::WARNING);
+            }
+        } else {
+            Logger::GetInstance().Log("Receivebuffer filled up!", Logger::Level::ERROR);
+        }
+        lLock.unlock();
+
+        if (lReturn) {
+            mCondition.notify_one();
         }
-    } else {
-        Logger::GetInstance().Log("Receivebuffer filled up!", Logger::Level::ERROR);
     }
     return lReturn;
 }
@@ -100,8 +101,7 @@ bool USBReceiveThread::AddToQueue(const USB_Constants::BinaryStitchUSBPacket& aS
 void USBReceiveThread::ClearQueues()
 {
     mMutex.lock();
-    std::queue<USB_Constants::BinaryStitchUSBPacket>().swap(mQueue);
-    mLastReceivedMessage = {};
+    std::queue<USB_Constants::BinaryWiFiPacket>().swap(mQueue);
     mMutex.unlock();
 }
 
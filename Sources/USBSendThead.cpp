@@ -2,151 +2,313 @@
 
 /* Copyright (c) 2021 [Rick de Bondt] - USBSendThread.cpp */
 
+#include <algorithm>
+#include <new>
+
 #include "../Includes/Logger.h"
 #include "../Includes/NetConversionFunctions.h"
+#include "../Includes/NetworkingHeaders.h"
+#include "../Includes/USBPacketViews.h"
 #include "../Includes/XLinkKaiConnection.h"
 
-USBSendThread::USBSendThread(int aMaxBufferSize) : mMaxBufferSize(aMaxBufferSize) {}
-
-bool USBSendThread::StartThread()
-{
-    bool lReturn{true};
-    if (mThread == nullptr) {
-        mDone   = false;
-        lReturn = true;
-        mThread = std::make_shared<std::thread>([&] {
-            while (!mStopRequest) {
-                mMutex.lock();
-                if (!mQueue.empty()) {
-                    // Do a deep copy so we can keep this mutex locked as short as possible
-                    USB_Constants::BinaryWiFiPacket lFrontOfQueue{mQueue.front()};
-                    mQueue.pop();
-                    mMutex.unlock();
-
-                    int lPacketIndex{0};
-                    mLastReceivedPacket = lFrontOfQueue;
-                    bool lContinue{true};
-                    while (lPacketIndex < lFrontOfQueue.length) {
-                        int lPacketSize{0};
-                        int lHeaderLength{0};
-
-                        USB_Constants::BinaryStitchUSBPacket lPacket{};
-
-                        // First packet when stitching has a bigger header size
-                        if (lPacketIndex == 0) {
-                            lHeaderLength = USB_Constants::cAsyncHeaderAndSubHeaderSize;
-                        } else {
-                            lHeaderLength = USB_Constants::cAsyncHeaderSize;
-                        }
-
-                        // If the size is bigger than the buffer, start stitching
-                        lPacket.stitch =
-                            (lFrontOfQueue.length - lPacketIndex) > (USB_Constants::cMaxUSBPacketSize - lHeaderLength);
-
-                        // Length is either the size of the USB buffer or what's left of the packet
-                        unsigned int lLength{lPacket.stitch ? USB_Constants::cMaxUSBPacketSize - lHeaderLength :
-                                                              lFrontOfQueue.length - lPacketIndex};
-
-                        // First add the packet header
-                        USB_Constants::AsyncCommand lCommand{};
-                        memset(&lCommand, 0, sizeof(lCommand));
-                        lCommand.channel = USB_Constants::cAsyncUserChannel;
-                        lCommand.magic   = USB_Constants::Asynchronous;
-
-                        memcpy(lPacket.data.data(), &lCommand, USB_Constants::cAsyncHeaderSize);
-                        lPacketSize += USB_Constants::cAsyncHeaderSize;
-
-                        // First packet needs a subheader
-                        if (lPacketIndex == 0) {
-                            USB_Constants::AsyncSubHeader lSubHeader{};
-                            memset(&lSubHeader, 0, USB_Constants::cAsyncSubHeaderSize);
-                            lSubHeader.magic = USB_Constants::DebugPrint;
-                            lSubHeader.mode  = 3;
-                            lSubHeader.ref   = 0;  // i don't know why this is 0
-                            lSubHeader.size  = lFrontOfQueue.length;
-                            Logger::GetInstance().Log("size = " + std::to_string(lFrontOfQueue.length),
-                                                      Logger::Level::TRACE);
-
-                            memcpy(lPacket.data.data() + lPacketSize, &lSubHeader, USB_Constants::cAsyncSubHeaderSize);
-                            lPacketSize += USB_Constants::cAsyncSubHeaderSize;
-                        }
-
-                        memcpy(lPacket.data.data() + lPacketSize, lFrontOfQueue.data.data() + lPacketIndex, lLength);
-                        lPacketSize += lLength;
-
-                        lPacket.length = lPacketSize;
-                        lPacketIndex += lLength;
-                        mOutgoingQueue.push(lPacket);
-                    }
-                } else {
-                    // Never forget to unlock a mutex
-                    mMutex.unlock();
-                }
-            }
-            std::this_thread::sleep_for(std::chrono::microseconds(10));
-        });
-        mDone   = true;
+using namespace USBSendThread_Constants;
+
+USBSendThread::USBSendThread(int aMaxBufferSize) : mMaxBufferSize(aMaxBufferSize)
+{
+    mFreeFrames.reserve(aMaxBufferSize);
+    AllocateFrames(nullptr);
+}
+
+void USBSendThread::AllocateFrames(libusb_device_handle* aDeviceHandle)
+{
+    for (auto& lQueue : mOutgoingQueues) {
+        std::queue<int>().swap(lQueue);
     }
-    return lReturn;
+    mDeficits.fill(0);
+    mOpenAggregates.fill(-1);
+    mQueuedFrames  = 0;
+    mSelectedClass = -1;
+    mFreeFrames.clear();
+    mFrames = nullptr;
+
+    if (mFrameMemory.Allocate(aDeviceHandle, sizeof(USB_Constants::USBFrame) * mMaxBufferSize)) {
+        // USBFrame is trivial, this only starts the lifetime of the frames in the new memory
+        mFrames = new (mFrameMemory.Data()) USB_Constants::USBFrame[mMaxBufferSize];
+        for (int lCount = mMaxBufferSize - 1; lCount >= 0; lCount--) {
+            mFreeFrames.push_back(lCount);
+        }
+    }
+
+    Logger::GetInstance().Log(std::string("Send buffers in ") +
+                                  (mFrameMemory.IsDeviceMemory() ? "device memory" : "normal memory"),
+                              Logger::Level::DEBUG);
+}
+
+void USBSendThread::UseDeviceMemory(libusb_device_handle* aDeviceHandle)
+{
+    std::lock_guard<std::mutex> lLock{mMutex};
+    AllocateFrames(aDeviceHandle);
+}
+
+void USBSendThread::Fragment(std::string_view aData, USB_Constants::USBFrame& aFrame)
+{
+    std::size_t lPacketIndex{0};
+    std::size_t lFrameSize{0};
+
+    while (lPacketIndex < aData.size()) {
+        // First add the packet header
+        memcpy(aFrame.data.data() + lFrameSize,
+               USB_Constants::cAsyncUserHeaderTemplate.data(),
+               USB_Constants::cAsyncHeaderSize);
+        lFrameSize += USB_Constants::cAsyncHeaderSize;
+
+        // First chunk when stitching has a bigger header size, because it needs a subheader
+        std::size_t lHeaderLength{USB_Constants::cAsyncHeaderSize};
+        if (lPacketIndex == 0) {
+            memcpy(aFrame.data.data() + lFrameSize,
+                   USB_Constants::cPacketSubHeaderTemplate.data(),
+                   USB_Constants::cAsyncSubHeaderSize);
+            StoreUnaligned<int32_t>(aFrame.data.data() + lFrameSize + USB_Constants::cSubHeaderSizeOffset,
+                                    static_cast<int32_t>(aData.size()));
+            lFrameSize += USB_Constants::cAsyncSubHeaderSize;
+            lHeaderLength = USB_Constants::cAsyncHeaderAndSubHeaderSize;
+        }
+
+        // Length is either what fits in the USB packet or what's left of the packet
+        std::size_t lLength{std::min<std::size_t>(aData.size() - lPacketIndex,
+                                                  USB_Constants::cMaxUSBPacketSize - lHeaderLength)};
+
+        memcpy(aFrame.data.data() + lFrameSize, aData.data() + lPacketIndex, lLength);
+        lFrameSize += lLength;
+        lPacketIndex += lLength;
+    }
+
+    aFrame.length = lFrameSize;
+}
+
+void USBSendThread::StartAggregate(std::string_view aData, USB_Constants::USBFrame& aFrame)
+{
+    std::size_t lFrameSize{0};
+
+    memcpy(aFrame.data.data(), USB_Constants::cAsyncUserHeaderTemplate.data(), USB_Constants::cAsyncHeaderSize);
+    lFrameSize += USB_Constants::cAsyncHeaderSize;
+    memcpy(aFrame.data.data() + lFrameSize,
+           USB_Constants::cAggregateSubHeaderTemplate.data(),
+           USB_Constants::cAsyncSubHeaderSize);
+    lFrameSize += USB_Constants::cAsyncSubHeaderSize;
+
+    // Size in the subheader is the size of everything after it, gets updated as frames are added
+    StoreUnaligned<int32_t>(
+        aFrame.data.data() + USB_Constants::cAsyncHeaderSize + USB_Constants::cSubHeaderSizeOffset,
+        static_cast<int32_t>(USB_Constants::cAggregateLengthSize + aData.size()));
+    StoreUnaligned<uint16_t>(aFrame.data.data() + lFrameSize, static_cast<uint16_t>(aData.size()));
+    lFrameSize += USB_Constants::cAggregateLengthSize;
+    memcpy(aFrame.data.data() + lFrameSize, aData.data(), aData.size());
+    lFrameSize += aData.size();
+
+    aFrame.length = lFrameSize;
 }
 
-void USBSendThread::StopThread()
+bool USBSendThread::AddToAggregate(std::string_view aData, int aClass)
 {
-    mStopRequest = true;
-    while (!mDone) {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+    bool             lReturn{false};
+    int              lFrameIndex{mOpenAggregates.at(aClass)};
+    std::queue<int>& lQueue{mOutgoingQueues.at(aClass)};
+
+    // The frame FrontOfOutgoingQueue() handed out may be on its way to USB already, leave it alone
+    if (lFrameIndex >= 0 && !(mSelectedClass == aClass && lQueue.front() == lFrameIndex)) {
+        USB_Constants::USBFrame& lFrame{mFrames[lFrameIndex]};
+        std::size_t              lRecordSize{USB_Constants::cAggregateLengthSize + aData.size()};
+
+        if (lFrame.length + lRecordSize <= USB_Constants::cMaxUSBPacketSize) {
+            char* lSizeField{lFrame.data.data() + USB_Constants::cAsyncHeaderSize +
+                             USB_Constants::cSubHeaderSizeOffset};
+            StoreUnaligned<int32_t>(lSizeField,
+                                    LoadUnaligned<int32_t>(lSizeField) + static_cast<int32_t>(lRecordSize));
+            StoreUnaligned<uint16_t>(lFrame.data.data() + lFrame.length, static_cast<uint16_t>(aData.size()));
+            memcpy(lFrame.data.data() + lFrame.length + USB_Constants::cAggregateLengthSize,
+                   aData.data(),
+                   aData.size());
+            lFrame.length += lRecordSize;
+            mAggregatedFrames++;
+            lReturn = true;
+        }
     }
-    ClearQueues();
-    if (mThread != nullptr && mThread->joinable()) {
-        mThread->join();
+
+    return lReturn;
+}
+
+bool USBSendThread::FitsInAggregate(std::string_view aData)
+{
+    return USB_Constants::cAggregateLengthSize + aData.size() <= USB_Constants::cMaxAggregatePayload;
+}
+
+USBSendThread_Constants::FrameClass USBSendThread::Classify(std::string_view aData) const
+{
+    FrameClass lReturn{FrameClass::Large};
+
+    // Group bit of the destination address is set for both broadcast and multicast
+    if (!aData.empty() && (aData[Net_8023_Constants::cDestinationAddressIndex] & 0x01) != 0) {
+        lReturn = FrameClass::BroadcastMulticast;
+    } else if (aData.size() <= static_cast<std::size_t>(mSmallFrameThreshold)) {
+        lReturn = FrameClass::SmallUnicast;
     }
-    mThread = nullptr;
+
+    return lReturn;
 }
 
 bool USBSendThread::AddToQueue(std::string_view aData)
 {
     bool lReturn{false};
-    if (mQueue.size() < mMaxBufferSize) {
-        lReturn = true;
-        USB_Constants::BinaryWiFiPacket lPacket{};
-        memcpy(lPacket.data.data(), aData.data(), aData.size());
-        lPacket.length = aData.size();
-
-        mMutex.lock();
-        mQueue.push(lPacket);
-        mMutex.unlock();
-        if (mQueue.size() > 50) {
-            Logger::GetInstance().Log("Sendbuffer got to over 50! " + std::to_string(mQueue.size()),
-                                      Logger::Level::WARNING);
+
+    if (aData.size() <= USB_Constants::cMaxAsynchronousBuffer) {
+        std::lock_guard<std::mutex> lLock{mMutex};
+        int  lClass{static_cast<int>(Classify(aData))};
+        bool lAggregate{mAggregation && FitsInAggregate(aData)};
+
+        if (lAggregate && AddToAggregate(aData, lClass)) {
+            lReturn = true;
+        } else if (!mFreeFrames.empty()) {
+            lReturn = true;
+            int lFrame{mFreeFrames.back()};
+            mFreeFrames.pop_back();
+
+            if (lAggregate) {
+                StartAggregate(aData, mFrames[lFrame]);
+                mOpenAggregates.at(lClass) = lFrame;
+            } else {
+                Fragment(aData, mFrames[lFrame]);
+                // Frames behind this one would go out before it
+                mOpenAggregates.at(lClass) = -1;
+            }
+            mOutgoingQueues.at(lClass).push(lFrame);
+            mQueuedFrames++;
+
+            if (mQueuedFrames > 50) {
+                Logger::GetInstance().Log("Sendbuffer got to over 50! " + std::to_string(mQueuedFrames),
+                                          Logger::Level::WARNING);
+            }
+        } else {
+            Logger::GetInstance().Log("Sendbuffer filled up!", Logger::Level::ERROR);
         }
     } else {
-        Logger::GetInstance().Log("Sendbuffer filled up!", Logger::Level::ERROR);
+        Logger::GetInstance().Log("Packet too big for the PSP: " + std::to_string(aData.size()), Logger::Level::ERROR);
     }
     return lReturn;
 }
 
 bool USBSendThread::HasOutgoingData()
 {
-    return !mOutgoingQueue.empty();
+    std::lock_guard<std::mutex> lLock{mMutex};
+    return mQueuedFrames > 0;
 }
 
-USB_Constants::BinaryStitchUSBPacket USBSendThread::PopFromOutgoingQueue()
+int USBSendThread::SelectClass()
 {
-    USB_Constants::BinaryStitchUSBPacket lReturn{};
-    if (!mOutgoingQueue.empty()) {
-        mMutex.lock();
-        lReturn = mOutgoingQueue.front();
-        mOutgoingQueue.pop();
-        mMutex.unlock();
+    int lReturn{-1};
+
+    if (mScheduler == Scheduler::StrictPriority) {
+        for (int lClass = 0; lClass < cClassCount && lReturn < 0; lClass++) {
+            if (!mOutgoingQueues.at(lClass).empty()) {
+                lReturn = lClass;
+            }
+        }
+    } else {
+        // Deficit round robin, every class gets its quantum of bytes per visit and keeps what it did not use as long
+        // as it has frames waiting. Ends because every quantum fits at least one frame.
+        while (lReturn < 0) {
+            std::queue<int>& lQueue{mOutgoingQueues.at(mCurrentClass)};
+            if (lQueue.empty()) {
+                mDeficits.at(mCurrentClass) = 0;
+            } else {
+                if (!mQuantumAdded) {
+                    mDeficits.at(mCurrentClass) += cQuanta.at(mCurrentClass);
+                    mQuantumAdded = true;
+                }
+                if (mFrames[lQueue.front()].length <= mDeficits.at(mCurrentClass)) {
+                    lReturn = mCurrentClass;
+                }
+            }
+
+            if (lReturn < 0) {
+                mCurrentClass = (mCurrentClass + 1) % cClassCount;
+                mQuantumAdded = false;
+            }
+        }
     }
+
     return lReturn;
 }
 
+USB_Constants::USBFrame& USBSendThread::FrontOfOutgoingQueue()
+{
+    std::lock_guard<std::mutex> lLock{mMutex};
+    if (mSelectedClass < 0) {
+        mSelectedClass = SelectClass();
+    }
+    return mFrames[mOutgoingQueues.at(mSelectedClass).front()];
+}
+
+void USBSendThread::PopFromOutgoingQueue()
+{
+    std::lock_guard<std::mutex> lLock{mMutex};
+    if (mSelectedClass >= 0) {
+        std::queue<int>& lQueue{mOutgoingQueues.at(mSelectedClass)};
+        mDeficits.at(mSelectedClass) -= mFrames[lQueue.front()].length;
+        if (mOpenAggregates.at(mSelectedClass) == lQueue.front()) {
+            mOpenAggregates.at(mSelectedClass) = -1;
+        }
+        mFreeFrames.push_back(lQueue.front());
+        lQueue.pop();
+        mQueuedFrames--;
+        mSelectedClass = -1;
+    }
+}
+
 void USBSendThread::ClearQueues()
 {
-    mMutex.lock();
-    std::queue<USB_Constants::BinaryWiFiPacket>().swap(mQueue);
-    std::queue<USB_Constants::BinaryStitchUSBPacket>().swap(mOutgoingQueue);
-    mLastReceivedPacket = {};
-    mMutex.unlock();
+    std::lock_guard<std::mutex> lLock{mMutex};
+    for (auto& lQueue : mOutgoingQueues) {
+        while (!lQueue.empty()) {
+            mFreeFrames.push_back(lQueue.front());
+            lQueue.pop();
+        }
+    }
+    mDeficits.fill(0);
+    mOpenAggregates.fill(-1);
+    mQueuedFrames  = 0;
+    mSelectedClass = -1;
+}
+
+void USBSendThread::SetScheduler(Scheduler aScheduler, int aSmallFrameThreshold)
+{
+    std::lock_guard<std::mutex> lLock{mMutex};
+    mScheduler           = aScheduler;
+    mSmallFrameThreshold = aSmallFrameThreshold;
+}
+
+void USBSendThread::SetAggregation(bool aEnabled)
+{
+    std::lock_guard<std::mutex> lLock{mMutex};
+    mAggregation = aEnabled;
+    mOpenAggregates.fill(-1);
+}
+
+uint64_t USBSendThread::GetAggregatedFrameCount()
+{
+    std::lock_guard<std::mutex> lLock{mMutex};
+    return mAggregatedFrames;
+}
+
+Scheduler USBSendThread::ConvertSchedulerStringToScheduler(std::string_view aScheduler)
+{
+    Scheduler lReturn{Scheduler::DeficitRoundRobin};
+
+    for (std::size_t lCount = 0; lCount < cSchedulerTexts.size(); lCount++) {
+        if (cSchedulerTexts.at(lCount) == aScheduler) {
+            lReturn = static_cast<Scheduler>(lCount);
+        }
+    }
+
+    return lReturn;
 }
@@ -0,0 +1,70 @@
+#include "../Includes/USBTransferMemory.h"
+
+/* Copyright (c) 2021 [Rick de Bondt] - USBTransferMemory.cpp */
+
+#include <string>
+
+#include <libusb.h>
+
+#include "../Includes/Logger.h"
+
+USBTransferMemory::~USBTransferMemory()
+{
+    Free();
+}
+
+bool USBTransferMemory::Allocate(libusb_device_handle* aDeviceHandle, std::size_t aSize)
+{
+    Free();
+
+// libusb_dev_mem_alloc got added in libusb 1.0.21
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    if (aDeviceHandle != nullptr) {
+        mData = reinterpret_cast<char*>(libusb_dev_mem_alloc(aDeviceHandle, aSize));
+        if (mData != nullptr) {
+            mDeviceHandle = aDeviceHandle;
+        } else {
+            Logger::GetInstance().Log("Device memory not available, using normal memory for " +
+                                          std::to_string(aSize) + " bytes",
+                                      Logger::Level::DEBUG);
+        }
+    }
+#endif
+
+    if (mData == nullptr) {
+        mFallback = std::make_unique<char[]>(aSize);
+        mData     = mFallback.get();
+    }
+
+    mSize = aSize;
+    return mData != nullptr;
+}
+
+void USBTransferMemory::Free()
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    if (mDeviceHandle != nullptr && mData != nullptr) {
+        libusb_dev_mem_free(mDeviceHandle, reinterpret_cast<unsigned char*>(mData), mSize);
+    }
+#endif
+
+    mData         = nullptr;
+    mDeviceHandle = nullptr;
+    mFallback     = nullptr;
+    mSize         = 0;
+}
+
+char* USBTransferMemory::Data() const
+{
+    return mData;
+}
+
+std::size_t USBTransferMemory::Size() const
+{
+    return mSize;
+}
+
+bool USBTransferMemory::IsDeviceMemory() const
+{
+    return mDeviceHandle != nullptr;
+}
@@ -2,11 +2,26 @@
 
 /* Copyright (c) 2020 [Rick de Bondt] - XLinkKaiConnection.cpp */
 
+#include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <thread>
 
+#if defined(USE_RECVMMSG)
+#include <cerrno>
+#include <sys/socket.h>
+#endif
+
+#if not defined(_MSC_VER) && not defined(__MINGW32__)
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#endif
+
 #include <boost/bind/bind.hpp>
 #include <boost/exception/diagnostic_information.hpp>
 
@@ -18,6 +33,31 @@ using namespace boost::asio;
 using namespace boost::placeholders;
 using namespace std::chrono_literals;
 
+/**
+ * Gets the broadcast addresses of all local IPv4 interfaces, including the limited broadcast address.
+ * @return List of broadcast addresses.
+ */
+static std::vector<ip::address_v4> GetBroadcastAddresses()
+{
+    std::vector<ip::address_v4> lReturn{ip::address_v4::broadcast()};
+
+#if not defined(_MSC_VER) && not defined(__MINGW32__)
+    ifaddrs* lInterfaces{nullptr};
+    if (getifaddrs(&lInterfaces) == 0) {
+        for (ifaddrs* lInterface = lInterfaces; lInterface != nullptr; lInterface = lInterface->ifa_next) {
+            if ((lInterface->ifa_addr != nullptr) && (lInterface->ifa_addr->sa_family == AF_INET) &&
+                ((lInterface->ifa_flags & IFF_BROADCAST) != 0U) && (lInterface->ifa_broadaddr != nullptr)) {
+                auto* lAddress{reinterpret_cast<sockaddr_in*>(lInterface->ifa_broadaddr)};
+                lReturn.emplace_back(ntohl(lAddress->sin_addr.s_addr));
+            }
+        }
+        freeifaddrs(lInterfaces);
+    }
+#endif
+
+    return lReturn;
+}
+
 XLinkKaiConnection::~XLinkKaiConnection()
 {
     Close();
@@ -35,7 +75,7 @@ bool XLinkKaiConnection::Open(std::string_view aIp, unsigned int aPort)
     std::string  lIp{aIp};
     unsigned int lPort{aPort};
 
-    // TODO: Do broadcast, but for now, use default stuff
+    // Nothing configured or discovered, use default stuff
     if (aIp.empty()) {
         lIp   = cIp;
         lPort = cPort;
@@ -55,6 +95,83 @@ bool XLinkKaiConnection::Open(std::string_view aIp, unsigned int aPort)
     return lReturn;
 }
 
+bool XLinkKaiConnection::Discover(const std::vector<std::string>& aKnownHosts, unsigned int aPort)
+{
+    bool lReturn{false};
+
+    io_context                lIoContext{};
+    ip::udp::socket           lSocket{lIoContext};
+    boost::system::error_code lError{};
+
+    lSocket.open(ip::udp::v4(), lError);
+    if (!lError) {
+        lSocket.set_option(socket_base::broadcast(true), lError);
+
+        std::vector<ip::address_v4> lTargets{GetBroadcastAddresses()};
+        lTargets.emplace_back(ip::make_address_v4(cIp));
+        for (const auto& lHost : aKnownHosts) {
+            ip::address_v4 lAddress{ip::make_address_v4(lHost, lError)};
+            if (!lError) {
+                lTargets.emplace_back(lAddress);
+            }
+        }
+
+        // Ask everyone at the same time, whoever answers first wins.
+        for (const auto& lTarget : lTargets) {
+            lSocket.send_to(buffer(cConnectString.data(), cConnectString.size()),
+                            ip::udp::endpoint(lTarget, aPort),
+                            0,
+                            lError);
+            if (lError) {
+                Logger::GetInstance().Log("Could not probe " + lTarget.to_string() + ": " + lError.message(),
+                                          Logger::Level::DEBUG);
+            }
+        }
+
+        std::array<char, cMaxLength> lData{};
+        ip::udp::endpoint            lSender{};
+        std::function<void(const boost::system::error_code&, std::size_t)> lReceiveHandler{
+            [&](const boost::system::error_code& aError, std::size_t aBytesReceived) {
+                if (!aError && std::string_view(lData.data(), aBytesReceived).starts_with(cConnectedString)) {
+                    lReturn = true;
+                    lIoContext.stop();
+                } else if (aError != error::operation_aborted) {
+                    // Unreachable hosts and unrelated messages end up here, keep listening.
+                    lSocket.async_receive_from(buffer(lData, cMaxLength), lSender, lReceiveHandler);
+                }
+            }};
+
+        lSocket.async_receive_from(buffer(lData, cMaxLength), lSender, lReceiveHandler);
+        lIoContext.run_for(cDiscoveryTimeout);
+
+        // Let every engine we asked know we will not be using this session.
+        for (const auto& lTarget : lTargets) {
+            lSocket.send_to(buffer(cDisconnectString.data(), cDisconnectString.size()),
+                            ip::udp::endpoint(lTarget, aPort),
+                            0,
+                            lError);
+        }
+        lSocket.close(lError);
+
+        if (lReturn) {
+            mIp   = lSender.address().to_string();
+            mPort = lSender.port();
+            Logger::GetInstance().Log("Found XLink Kai at " + mIp + ":" + std::to_string(mPort), Logger::Level::INFO);
+        } else {
+            Logger::GetInstance().Log("Could not find XLink Kai on the network", Logger::Level::WARNING);
+        }
+    } else {
+        Logger::GetInstance().Log("Failed to open discovery socket: " + lError.message(), Logger::Level::ERROR);
+    }
+
+    return lReturn;
+}
+
+std::string_view XLinkKaiConnection::GetIp() const
+{
+    return mIp;
+}
+
 bool XLinkKaiConnection::Connect()
 {
     bool lReturn{true};
@@ -62,7 +179,15 @@ bool XLinkKaiConnection::Connect()
     if (Send(cConnectString, "")) {
         // Start the timer for receiving a confirmation from XLink Kai.
         mConnectInitiated = true;
-        mConnectionTimerStart += (std::chrono::system_clock::now() - mConnectionTimerStart);
+        mConnectSent      = std::chrono::steady_clock::now();
+        std::chrono::milliseconds lTimeout{cConnectionTimeout};
+        if (mEndpoints.size() > 1) {
+            // Don't wait longer than the failover deadline when there is another engine to try.
+            lTimeout = std::min<std::chrono::milliseconds>(mFailoverTimeout, cConnectionTimeout);
+        }
+        mConnectTimer.expires_after(lTimeout);
+        mConnectTimer.async_wait(
+            boost::bind(&XLinkKaiConnection::ConnectTimeoutCallback, this, placeholders::error));
     } else {
         // Logging in send function
         lReturn = false;
@@ -75,25 +200,50 @@ bool XLinkKaiConnection::Send(std::string_view aCommand, std::string_view aData)
     bool lReturn{true};
 
     // We only allow connection/disconnection requests to be sent, when XLink Kai has not confirmed the connection yet.
-    if (mSocket.is_open()) {
-        if ((mConnected || aCommand == cConnectString || aCommand == cDisconnectString)) {
-            try {
-                if (aCommand == cEthernetDataString) {
-                    Logger::GetInstance().Log("Sent: " + std::string(aCommand) + PrettyHexString(aData),
-                                              Logger::Level::TRACE);
-                } else {
-                    Logger::GetInstance().Log("Sent: " + std::string(aCommand) + aData.data(), Logger::Level::DEBUG);
-                }
+    if (mConnected || aCommand == cConnectString || aCommand == cDisconnectString) {
+        if (Logger::GetInstance().GetLogLevel() <= Logger::Level::DEBUG) {
+            Logger::GetInstance().Log("Sent: " + std::string(aCommand) + std::string(aData), Logger::Level::DEBUG);
+        }
+        lReturn = SendTo(aCommand, aData);
+    } else {
+        Logger::GetInstance().Log("No other messages before Xlink Kai has connected!", Logger::Level::DEBUG);
+        lReturn = false;
+    }
+    return lReturn;
+}
 
-                mSocket.send_to(buffer(std::string(aCommand) + std::string(aData)), mRemote);
-            } catch (const boost::system::system_error& lException) {
-                Logger::GetInstance().Log(
-                    "Could not send message! " + std::string(aData) + std::string(lException.what()),
-                    Logger::Level::ERROR);
-                lReturn = false;
-            }
-        } else {
-            Logger::GetInstance().Log("No other messages before Xlink Kai has connected!", Logger::Level::DEBUG);
+bool XLinkKaiConnection::Send(std::string_view aData)
+{
+    bool lReturn{true};
+
+    // Ethernet data is only allowed when XLink Kai has confirmed the connection, no need to look at the command.
+    if (mConnected) {
+        if (Logger::GetInstance().GetLogLevel() == Logger::Level::TRACE) {
+            Logger::GetInstance().Log("Sent: " + std::string(cEthernetDataString) + PrettyHexString(aData),
+                                      Logger::Level::TRACE);
+        }
+        lReturn = SendTo(cEthernetDataString, aData);
+    } else {
+        Logger::GetInstance().Log("No other messages before Xlink Kai has connected!", Logger::Level::DEBUG);
+        lReturn = false;
+    }
+    return lReturn;
+}
+
+bool XLinkKaiConnection::SendTo(std::string_view aCommand, std::string_view aData)
+{
+    bool lReturn{true};
+
+    if (mSocket.is_open()) {
+        try {
+            // Command and data go out as one datagram straight from their own buffers (scatter/gather).
+            const std::array<const_buffer, 2> lBuffers{buffer(aCommand.data(), aCommand.size()),
+                                                       buffer(aData.data(), aData.size())};
+            mSocket.send_to(lBuffers, mRemote);
+        } catch (const boost::system::system_error& lException) {
+            Logger::GetInstance().Log(
+                "Could not send message! " + std::string(aCommand) + std::string(lException.what()),
+                Logger::Level::ERROR);
             lReturn = false;
         }
     } else {
@@ -104,11 +254,6 @@ bool XLinkKaiConnection::Send(std::string_view aCommand, std::string_view aData)
     return lReturn;
 }
 
-bool XLinkKaiConnection::Send(std::string_view aData)
-{
-    return Send(cEthernetDataString, aData);
-}
-
 bool XLinkKaiConnection::HandleKeepAlive()
 {
     bool lReturn{true};
@@ -123,127 +268,318 @@ bool XLinkKaiConnection::ReadNextData()
 {
     bool lReturn{true};
 
-    size_t lBytesReceived{mSocket.receive_from(buffer(mData, cMaxLength), mRemote)};
+    size_t lBytesReceived{mSocket.receive_from(buffer(mData, cMaxLength), mSender)};
 
     if (lBytesReceived > 0) {
-        ReceiveCallback(boost::system::error_code(), lBytesReceived);
+        HandleMessage(std::string_view(mData.data(), lBytesReceived));
     }
 
     return lReturn;
 }
 
-void XLinkKaiConnection::ReceiveCallback(const boost::system::error_code& /*aError*/, size_t aBytesReceived)
+void XLinkKaiConnection::ReceiveCallback(const boost::system::error_code& aError, size_t aBytesReceived)
 {
-    std::string lData{mData.begin(), mData.begin() + aBytesReceived};
+    if (aError == error::operation_aborted) {
+        // Socket got closed, whoever closed it will start receiving again.
+        return;
+    }
 
-    // If we actually received anything useful, react.
-    if (!lData.empty()) {
-        // Make sure the keepalive timer gets tickled so it doesn't bite.
-        mKeepAliveTimerStart += (std::chrono::system_clock::now() - mKeepAliveTimerStart);
-        std::size_t lFirstSeparator{lData.find(cSeparator)};
-        std::string lCommand{lData.substr(0, lFirstSeparator + 1)};
+    if (aError == error::connection_refused && (mConnected || mConnectInitiated)) {
+        // Nobody is listening on the other side anymore, no need to wait for a timeout to tell us that.
+        HandleConnectionLost("KaiEngine is not reachable anymore");
+    } else {
+        if (aError) {
+            Logger::GetInstance().Log("Receiving from XLink Kai failed: " + aError.message(), Logger::Level::DEBUG);
+        } else {
+            HandleMessage(std::string_view(mData.data(), aBytesReceived));
+        }
+
+        StartReceiving();
+    }
+}
 
-        if (lCommand != std::string(cEthernetDataFormat) + cSeparator.data()) {
-            Logger::GetInstance().Log("Received: " + lCommand + lData, Logger::Level::TRACE);
+#if defined(USE_RECVMMSG)
+void XLinkKaiConnection::ReadableCallback(const boost::system::error_code& aError)
+{
+    if (aError == error::operation_aborted) {
+        // Socket got closed, whoever closed it will start receiving again.
+        return;
+    }
+
+    if (aError) {
+        Logger::GetInstance().Log("Waiting for XLink Kai failed: " + aError.message(), Logger::Level::DEBUG);
+    } else {
+        std::array<iovec, cMaxBatchedMessages>   lVectors{};
+        std::array<mmsghdr, cMaxBatchedMessages> lMessages{};
+        for (std::size_t lCount = 0; lCount < cMaxBatchedMessages; lCount++) {
+            lVectors.at(lCount).iov_base            = mBatchData.at(lCount).data();
+            lVectors.at(lCount).iov_len             = cMaxLength;
+            lMessages.at(lCount).msg_hdr.msg_iov    = &lVectors.at(lCount);
+            lMessages.at(lCount).msg_hdr.msg_iovlen = 1;
         }
 
-        if (!mConnected && (lCommand == std::string(cConnectedFormat) + cSeparator.data())) {
-            lCommand = lData.substr(0, cConnectedString.size());
-            if (lCommand == cConnectedString) {
-                Logger::GetInstance().Log("XLink Kai succesfully connected: " + lCommand, Logger::Level::INFO);
-                mConnectInitiated = false;
-                mConnected        = true;
+        // Drain everything the kernel has queued for us, a full batch means there may be more waiting.
+        int lAmountReceived{0};
+        do {
+            lAmountReceived =
+                recvmmsg(mSocket.native_handle(), lMessages.data(), cMaxBatchedMessages, MSG_DONTWAIT, nullptr);
+            for (int lCount = 0; lCount < lAmountReceived; lCount++) {
+                HandleMessage(std::string_view(mBatchData.at(lCount).data(), lMessages.at(lCount).msg_len));
             }
+        } while (lAmountReceived == static_cast<int>(cMaxBatchedMessages) && mSocket.is_open());
+
+        if (lAmountReceived < 0 && errno == ECONNREFUSED && (mConnected || mConnectInitiated)) {
+            // Nobody is listening on the other side anymore, no need to wait for a timeout to tell us that.
+            HandleConnectionLost("KaiEngine is not reachable anymore");
+            return;
         }
 
-        // If no connection confirmation has been sent on XLink Kai's side, Don't care about any other message yet
-        if (mConnected) {
-            if (lCommand == cKeepAliveString) {
-                HandleKeepAlive();
-            } else if (lCommand == std::string(cEthernetDataFormat) + cSeparator.data()) {
-                // For data XLink Kai uses e;e; which doesn't filter all that well, so if we find e; just check if this
-                // is e;e;
-                lCommand = lData.substr(0, cEthernetDataString.size());
+        if (lAmountReceived < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            Logger::GetInstance().Log("Receiving from XLink Kai failed: " + std::string(strerror(errno)),
+                                      Logger::Level::DEBUG);
+        }
+    }
 
-                Logger::GetInstance().Log("Received: " + PrettyHexString(lData.substr(cEthernetDataString.length())),
-                                          Logger::Level::TRACE);
+    if (mSocket.is_open()) {
+        StartReceiving();
+    }
+}
+#endif
 
-                if (lCommand == cEthernetDataString) {
-                    if (mIncomingConnection != nullptr) {
-                        // Strip e;e;
-                        mEthernetData =
-                            lData.substr(cEthernetDataString.length(), lData.length() - cEthernetDataString.length());
+void XLinkKaiConnection::HandleMessage(std::string_view aData)
+{
+    std::string_view lData{aData};
+
+    // If we actually received anything useful, react.
+    if (!lData.empty()) {
+        // Make sure the keepalive timer gets tickled so it doesn't bite.
+        mLastReceived     = std::chrono::steady_clock::now();
+        mUnansweredProbes = 0;
 
-                        mIncomingConnection->Send(mEthernetData);
+        // Only format the message when it will actually be logged, this is the hot path.
+        const bool lTrace{Logger::GetInstance().GetLogLevel() == Logger::Level::TRACE};
+        KaiCommand lCommand{ParseCommand(lData)};
+
+        if (lTrace && lCommand != KaiCommand::EthernetData) {
+            Logger::GetInstance().Log("Received: " + std::string(lData), Logger::Level::TRACE);
+        }
+
+        if (!mConnected && (lCommand == KaiCommand::Connected)) {
+            Logger::GetInstance().Log("XLink Kai succesfully connected: " + std::string(lData), Logger::Level::INFO);
+            mConnectInitiated = false;
+            mConnected        = true;
+            mReconnectDelay   = cReconnectDelay;
+            mSessionGeneration++;
+            mConnectTimer.cancel();
+
+            mRoundTripTime =
+                std::chrono::duration_cast<std::chrono::microseconds>(mLastReceived - mConnectSent).count();
+            Logger::GetInstance().Log("XLink Kai round trip: " + std::to_string(mRoundTripTime) + " us",
+                                      Logger::Level::DEBUG);
+
+            if (mFailingOver) {
+                mFailingOver      = false;
+                mFailoverAttempts = 0;
+                mLastFailoverTime =
+                    std::chrono::duration_cast<std::chrono::milliseconds>(mLastReceived - mFailoverStart);
+                Logger::GetInstance().Log("Failover to " + mIp + ":" + std::to_string(mPort) + " took " +
+                                              std::to_string(mLastFailoverTime.count()) + " ms",
+                                          Logger::Level::INFO);
+            }
+
+            Send(cSettingDDSOnlyString, "");
+            StartKeepAliveTimer();
+        } else if (mConnected) {
+            // If no connection confirmation has been sent on XLink Kai's side, Don't care about any other message yet
+            switch (lCommand) {
+                case KaiCommand::EthernetData:
+                    if (!mIncomingConnections.empty()) {
+                        // Strip e;e;
+                        std::string_view lEthernetData{lData.substr(cEthernetDataString.size())};
+                        if (lTrace) {
+                            Logger::GetInstance().Log("Received: " + PrettyHexString(lEthernetData),
+                                                      Logger::Level::TRACE);
+                        }
+
+                        for (auto& lIncomingConnection : mIncomingConnections) {
+                            lIncomingConnection->Send(lEthernetData);
+                        }
+                    }
+                    break;
+                case KaiCommand::KeepAlive:
+                    if (mProbeOutstanding) {
+                        // Answer to our own probe, replying would start a ping-pong
+                        mProbeOutstanding = false;
+                    } else {
+                        HandleKeepAlive();
                     }
-                } else if (lCommand == cEthernetDataMetaString) {
-                    if (lData.substr(cEthernetDataMetaString.length(), cSetESSIDFormat.length()) == cSetESSIDFormat) {
-                        Logger::GetInstance().Log(
-                            "XLink Kai gave us the following ESSID: " + lData.substr(cSetESSIDString.length()),
-                            Logger::Level::DEBUG);
+                    break;
+                case KaiCommand::EthernetDataMeta:
+                    if (lData.starts_with(cSetESSIDString)) {
+                        Logger::GetInstance().Log("XLink Kai gave us the following ESSID: " +
+                                                      std::string(lData.substr(cSetESSIDString.size())),
+                                                  Logger::Level::DEBUG);
                     } else {
-                        Logger::GetInstance().Log(std::string("Unrecognized e;d message from XLink Kai: ") + lData,
+                        Logger::GetInstance().Log("Unrecognized e;d message from XLink Kai: " + std::string(lData),
                                                   Logger::Level::DEBUG);
                     }
-                }
-            } else if (lCommand == std::string(cDisconnectedFormat) + cSeparator.data()) {
-                lCommand = lData.substr(0, cDisconnectedString.size());
-                if (lCommand == cDisconnectedString) {
-                    Logger::GetInstance().Log("Xlink Kai has disconnected us! " + lCommand, Logger::Level::ERROR);
-                    mConnected = false;
-                }
+                    break;
+                case KaiCommand::Disconnected:
+                    HandleConnectionLost("Xlink Kai has disconnected us! " + std::string(lData));
+                    break;
+                default:
+                    break;
             }
         }
     }
+}
+
+void XLinkKaiConnection::StartReceiving()
+{
+#if defined(USE_RECVMMSG)
+    // Only wait for the socket to become readable, ReadableCallback picks up as many messages as it can at once.
+    mSocket.async_wait(ip::udp::socket::wait_read,
+                       boost::bind(&XLinkKaiConnection::ReadableCallback, this, placeholders::error));
+#else
+    mSocket.async_receive_from(
+        buffer(mData, cMaxLength),
+        mSender,
+        boost::bind(&XLinkKaiConnection::ReceiveCallback, this, placeholders::error, placeholders::bytes_transferred));
+#endif
+}
+
+void XLinkKaiConnection::ConnectTimeoutCallback(const boost::system::error_code& aError)
+{
+    if (!aError && !mConnected && mConnectInitiated) {
+        HandleConnectionLost("Timeout waiting for XLink Kai to connect");
+    }
+}
+
+void XLinkKaiConnection::KeepAliveCallback(const boost::system::error_code& aError)
+{
+    if (!aError && mConnected) {
+        std::chrono::steady_clock::time_point lNow{std::chrono::steady_clock::now()};
+        // With fallbacks silence alone doesn't count, the engine has to have ignored our probes as well.
+        bool lProbed{mEndpoints.size() <= 1 || mUnansweredProbes >= cMaxUnansweredProbes};
+
+        if (lNow > (mLastReceived + GetKeepAliveTimeout()) && lProbed) {
+            // KaiEngine stopped sending keepalive messages, must've died.
+            HandleConnectionLost("It seems KaiEngine has stopped responding, resetting connection ...");
+        } else {
+            if (mEndpoints.size() > 1 && lNow >= (mLastReceived + GetProbeInterval())) {
+                // Been quiet for a while, ask if it is still there
+                mUnansweredProbes++;
+                mProbeOutstanding = true;
+                Send(cKeepAliveString, "");
+            }
+            StartKeepAliveTimer();
+        }
+    }
+}
+
+void XLinkKaiConnection::StartKeepAliveTimer()
+{
+    if (mEndpoints.size() > 1) {
+        mKeepAliveTimer.expires_after(GetProbeInterval());
+    } else {
+        mKeepAliveTimer.expires_at(mLastReceived + GetKeepAliveTimeout());
+    }
+    mKeepAliveTimer.async_wait(boost::bind(&XLinkKaiConnection::KeepAliveCallback, this, placeholders::error));
+}
+
+std::chrono::milliseconds XLinkKaiConnection::GetProbeInterval() const
+{
+    return std::max(mFailoverTimeout / cProbesPerFailoverTimeout, std::chrono::milliseconds(1));
+}
+
+std::chrono::milliseconds XLinkKaiConnection::GetKeepAliveTimeout() const
+{
+    // Only cut the wait short when there is somewhere else to go.
+    return mEndpoints.size() > 1 ? mFailoverTimeout : std::chrono::milliseconds(cKeepAliveTimeout);
+}
+
+void XLinkKaiConnection::HandleConnectionLost(const std::string& aReason)
+{
+    Logger::GetInstance().Log(aReason, Logger::Level::ERROR);
+
+    mConnected        = false;
+    mConnectInitiated = false;
+    mUnansweredProbes = 0;
+    mProbeOutstanding = false;
+    mConnectTimer.cancel();
+    mKeepAliveTimer.cancel();
+
+    if (mEndpoints.size() > 1) {
+        if (!mFailingOver) {
+            mFailingOver      = true;
+            mFailoverStart    = std::chrono::steady_clock::now();
+            mFailoverAttempts = 0;
+        }
+
+        mEndpointIndex = (mEndpointIndex + 1) % mEndpoints.size();
+        mIp            = mEndpoints.at(mEndpointIndex).first;
+        mPort          = mEndpoints.at(mEndpointIndex).second;
+        mFailoverAttempts++;
+
+        // Go to the next engine right away, only back off once all of them have been tried.
+        if (mFailoverAttempts < mEndpoints.size()) {
+            Logger::GetInstance().Log("Failing over to " + mIp + ":" + std::to_string(mPort), Logger::Level::INFO);
+            // Not right here, whoever noticed the loss may still re-arm a receive on the old socket after we return.
+            post(mIoContext, [this] { Reconnect(); });
+        } else {
+            mFailoverAttempts = 0;
+            ScheduleReconnect();
+        }
+    } else {
+        ScheduleReconnect();
+    }
+}
+
+void XLinkKaiConnection::Reconnect()
+{
+    // Lost connection somewhere, reconnect.
+    Close(false);
+
+    if (Open(mIp, mPort)) {
+        StartReceiving();
+        if (!Connect()) {
+            ScheduleReconnect();
+        }
+    } else {
+        ScheduleReconnect();
+    }
+}
 
-    StartReceiverThread();
+void XLinkKaiConnection::ScheduleReconnect()
+{
+    mReconnectTimer.expires_after(mReconnectDelay);
+    mReconnectTimer.async_wait([this](const boost::system::error_code& aError) {
+        if (!aError) {
+            Reconnect();
+        }
+    });
+    mReconnectDelay = std::min(mReconnectDelay * 2, cMaxReconnectDelay);
 }
 
 bool XLinkKaiConnection::StartReceiverThread()
 {
     bool lReturn{true};
     if (mSocket.is_open()) {
-        mSocket.async_receive_from(
-            buffer(mData, cMaxLength),
-            mRemote,
-            boost::bind(
-                &XLinkKaiConnection::ReceiveCallback, this, placeholders::error, placeholders::bytes_transferred));
-        // Run
         if (mReceiverThread == nullptr) {
+            // Whatever we are connected to now is the primary engine, the fallbacks come after it.
+            if (!mFallbacks.empty()) {
+                mEndpoints = {{mIp, mPort}};
+                mEndpoints.insert(mEndpoints.end(), mFallbacks.begin(), mFallbacks.end());
+                mEndpointIndex = 0;
+            }
+
+            mIoContext.restart();
+            // The state machine starts out disconnected, so the first thing it does is connect to XLink Kai.
+            post(mIoContext, [this] { Reconnect(); });
             mReceiverThread = std::make_shared<std::thread>([&] {
-                mIoService.restart();
-                while (!mIoService.stopped()) {
-                    if ((!mConnected && !mConnectInitiated)) {
-                        // Lost connection somewhere, reconnect.
-                        Close(false);
-                        Open(mIp, mPort);
-                        Connect();
-                        std::this_thread::sleep_for(std::chrono::seconds(1));
-                    } else if ((!mConnected) && mConnectInitiated &&
-                               (std::chrono::system_clock::now() > (mConnectionTimerStart + cConnectionTimeout))) {
-                        Logger::GetInstance().Log("Timeout waiting for XLink Kai to connect", Logger::Level::ERROR);
-                        mConnectInitiated = false;
-                        mConnected        = false;
-                        mSettingsSent     = false;
-                        // Retry in 10 seconds
-                        std::this_thread::sleep_for(10s);
-                    } else if (mConnected && !mConnectInitiated &&
-                               (std::chrono::system_clock::now() > (mKeepAliveTimerStart + cKeepAliveTimeout))) {
-                        // KaiEngine stopped sending keepalive messages, must've died.
-                        Logger::GetInstance().Log("It seems KaiEngine has stopped responding, resetting connection ...",
-                                                  Logger::Level::ERROR);
-                        mConnected        = false;
-                        mConnectInitiated = false;
-                        mSettingsSent     = false;
-                    } else if (mConnected && !mConnectInitiated && !mSettingsSent) {
-                        Send(cSettingDDSOnlyString, "");
-                        mSettingsSent = true;
-                    } else {
-                        mIoService.poll();
-                        // Very small delay to make the computer happy
-                        std::this_thread::sleep_for(10us);
-                    }
-                }
+                // Keep running when there is nothing left to wait for, only Close() may stop us.
+                auto lWorkGuard{make_work_guard(mIoContext)};
+                mIoContext.run();
             });
         }
     } else {
@@ -270,13 +606,17 @@ void XLinkKaiConnection::Close(bool aKillThread)
         }
 
         if (aKillThread && mReceiverThread != nullptr) {
-            if (!mIoService.stopped()) {
-                mIoService.stop();
+            if (!mIoContext.stopped()) {
+                mIoContext.stop();
             }
             mReceiverThread->join();
             mReceiverThread = nullptr;
         }
 
+        mConnectTimer.cancel();
+        mKeepAliveTimer.cancel();
+        mReconnectTimer.cancel();
+
         if (mSocket.is_open()) {
             mSocket.close();
         }
@@ -295,12 +635,71 @@ void XLinkKaiConnection::SetUseHostSSID(bool aUseHostSSID)
     mUseHostSSID = aUseHostSSID;
 }
 
+void XLinkKaiConnection::SetFallbacks(std::string_view aFallbacks)
+{
+    mFallbacks.clear();
+
+    std::string_view lFallbacks{aFallbacks};
+    while (!lFallbacks.empty()) {
+        std::size_t      lSeparator{lFallbacks.find(',')};
+        std::string_view lEntry{lFallbacks.substr(0, lSeparator)};
+        lFallbacks = (lSeparator == std::string_view::npos) ? std::string_view{} : lFallbacks.substr(lSeparator + 1);
+
+        if (!lEntry.empty()) {
+            std::size_t  lPortSeparator{lEntry.find(':')};
+            unsigned int lPort{cPort};
+            try {
+                if (lPortSeparator != std::string_view::npos) {
+                    int lParsedPort{std::stoi(std::string(lEntry.substr(lPortSeparator + 1)))};
+                    if (lParsedPort <= 0 || lParsedPort > std::numeric_limits<uint16_t>::max()) {
+                        throw std::out_of_range("Port out of range");
+                    }
+                    lPort = static_cast<unsigned int>(lParsedPort);
+                }
+
+                std::string lIp{lEntry.substr(0, lPortSeparator)};
+                // Make sure it is an address we can actually use before accepting it.
+                ip::make_address_v4(lIp);
+                mFallbacks.emplace_back(lIp, lPort);
+            } catch (const std::exception&) {
+                Logger::GetInstance().Log("Ignoring invalid XLink Kai fallback: " + std::string(lEntry),
+                                          Logger::Level::ERROR);
+            }
+        }
+    }
+}
+
+void XLinkKaiConnection::SetFailoverTimeout(std::chrono::milliseconds aTimeout)
+{
+    mFailoverTimeout = aTimeout;
+}
+
+std::chrono::milliseconds XLinkKaiConnection::GetLastFailoverTime() const
+{
+    return mLastFailoverTime;
+}
+
 void XLinkKaiConnection::SetPort(unsigned int aPort)
 {
     mPort = aPort;
 }
 
-void XLinkKaiConnection::SetIncomingConnection(std::shared_ptr<USBReader> aDevice)
+void XLinkKaiConnection::AddIncomingConnection(std::shared_ptr<USBReader> aDevice)
+{
+    mIncomingConnections.push_back(aDevice);
+}
+
+std::chrono::microseconds XLinkKaiConnection::GetRoundTripTime() const
+{
+    return std::chrono::microseconds(mRoundTripTime);
+}
+
+bool XLinkKaiConnection::IsConnected() const
+{
+    return mConnected;
+}
+
+uint64_t XLinkKaiConnection::GetSessionGeneration() const
 {
-    mIncomingConnection = aDevice;
+    return mSessionGeneration;
 }
@@ -1,37 +1,64 @@
+#include <array>
 #include <iostream>
-#include <memory>
 #include <string>
 #include <string_view>
+#include <thread>
 
+#include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 
 #undef timeout
 
+#include "Includes/Engine.h"
 #include "Includes/Logger.h"
 #include "Includes/NetConversionFunctions.h"
 #include "Includes/SettingsModel.h"
-#include "Includes/USBReader.h"
-#include "Includes/XLinkKaiConnection.h"
 
 namespace
 {
     constexpr std::string_view cLogFileName{"log.txt"};
     constexpr bool             cLogToDisk{true};
     constexpr std::string_view cConfigFileName{"config.txt"};
-
-    // Indicates if the program should be running or not, used to gracefully exit the program.
-    bool gRunning{true};
 }  // namespace
 
 
-static void SignalHandler(const boost::system::error_code& aError, int aSignalNumber)
+/**
+ * Passes a signal on to the engine.
+ * @return false if the program is quitting.
+ */
+static bool SignalHandler(const boost::system::error_code& aError, int aSignalNumber, Engine& aEngine)
 {
+    bool lReturn{!aError};
     if (!aError) {
         if (aSignalNumber == SIGINT || aSignalNumber == SIGTERM) {
             // Quit gracefully.
-            gRunning = false;
+            aEngine.Quit();
+            lReturn = false;
+        }
+#if not defined(_MSC_VER) && not defined(__MINGW32__)
+        if (aSignalNumber == SIGUSR1) {
+            aEngine.RequestFlowLog();
+        }
+        if (aSignalNumber == SIGHUP) {
+            aEngine.PostCommand(SettingsModel_Constants::Command::RestartEngine);
         }
+#endif
     }
+    return lReturn;
+}
+
+/**
+ * Waits for the next signal, keeps waiting after handling one.
+ * @param aSignals - Signals to wait for.
+ * @param aEngine - Engine to pass them on to.
+ */
+static void WaitForSignals(boost::asio::signal_set& aSignals, Engine& aEngine)
+{
+    aSignals.async_wait([&aSignals, &aEngine](const boost::system::error_code& aError, int aSignalNumber) {
+        if (SignalHandler(aError, aSignalNumber, aEngine)) {
+            WaitForSignals(aSignals, aEngine);
+        }
+    });
 }
 
 int main(int argc, char* argv[])
@@ -52,11 +79,6 @@ int main(int argc, char* argv[])
     }
 #endif
 
-    // Handle quit signals gracefully.
-    boost::asio::io_service lSignalIoService{};
-    boost::asio::signal_set lSignals(lSignalIoService, SIGINT, SIGTERM);
-    lSignals.async_wait(&SignalHandler);
-    std::thread   lThread{[lIoService = &lSignalIoService] { lIoService->run(); }};
     SettingsModel mSettingsModel{};
     mSettingsModel.LoadFromFile(lProgramPath + cConfigFileName.data());
 
@@ -65,57 +87,22 @@ int main(int argc, char* argv[])
 
     Logger::GetInstance().Log("CWUSB, by CodedWrench", Logger::Level::INFO);
 
-    std::shared_ptr<XLinkKaiConnection> lXLinkKaiConnection{std::make_shared<XLinkKaiConnection>()};
-    std::shared_ptr<USBReader> lUSBReaderConnection{std::make_shared<USBReader>(mSettingsModel.mMaxBufferedMessages,
-                                                                                mSettingsModel.mMaxFatalRetries,
-                                                                                mSettingsModel.mMaxReadWriteRetries,
-                                                                                mSettingsModel.mReadTimeOutMS,
-                                                                                mSettingsModel.mWriteTimeOutMS)};
-
-    bool lSuccess{false};
-    bool lUSBSuccess{false};
-
-    while (((!lUSBSuccess) || (!lSuccess)) && gRunning) {
-        // Try to open Xlink Connection
-        if (!lSuccess) {
-            lSuccess = lXLinkKaiConnection->Open(mSettingsModel.mXLinkIp, std::stoi(mSettingsModel.mXLinkPort));
-            if (!lSuccess) {
-                Logger::GetInstance().Log("Could not open XLink Kai connection, retrying in 10 seconds",
-                                          Logger::Level::INFO);
-                lXLinkKaiConnection->Close();
-            }
-        }
-
-        // Try to open USB Connection
-        if (!lUSBSuccess) {
-            lUSBSuccess = lUSBReaderConnection->Open();
-            if (!lUSBSuccess) {
-                Logger::GetInstance().Log("Could not open USB connection, retrying in 10 seconds", Logger::Level::INFO);
-                lUSBReaderConnection->Close();
-            }
-        }
+    Engine lEngine{mSettingsModel, lProgramPath, lProgramPath + cConfigFileName.data()};
 
-        if (!lSuccess || !lUSBSuccess) {
-            // Try again in 10 seconds
-            std::this_thread::sleep_for(std::chrono::seconds(10));
-        }
-    }
-
-    lUSBReaderConnection->SetIncomingConnection(lXLinkKaiConnection);
-    lXLinkKaiConnection->SetIncomingConnection(lUSBReaderConnection);
-
-    if (lXLinkKaiConnection->StartReceiverThread() && lUSBReaderConnection->StartReceiverThread()) {
-        mSettingsModel.mEngineStatus = SettingsModel_Constants::EngineStatus::Running;
-        while (gRunning) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-        }
-    } else {
-        Logger::GetInstance().Log("Failed to start receiver threads", Logger::Level::ERROR);
-        mSettingsModel.mEngineStatus = SettingsModel_Constants::EngineStatus::Error;
-    }
+    // Handle quit signals gracefully.
+    boost::asio::io_service lSignalIoService{};
+    boost::asio::signal_set lSignals(lSignalIoService, SIGINT, SIGTERM);
+#if not defined(_MSC_VER) && not defined(__MINGW32__)
+    // kill -USR1 logs the flow tables, to see who floods the link or arrives late
+    lSignals.add(SIGUSR1);
+    // kill -HUP reloads the config and restarts the bridge without restarting the program
+    lSignals.add(SIGHUP);
+#endif
+    WaitForSignals(lSignals, lEngine);
+    std::thread lThread{[lIoService = &lSignalIoService] { lIoService->run(); }};
 
-    lUSBReaderConnection->Close();
-    lXLinkKaiConnection->Close();
+    lEngine.PostCommand(SettingsModel_Constants::Command::StartEngine);
+    lEngine.Run();
 
     lSignalIoService.stop();
     if (lThread.joinable()) {